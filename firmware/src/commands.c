@@ -1,7 +1,11 @@
+#include <stm32f10x.h>
 #include <stdint.h>
 
+#include "hacks.h"
 #include "swd.h"
+#include "swd_phy.h"
 #include "gpio.h"
+#include "commands.h"
 
 void cmd_swd_enable(int enabled)
 {
@@ -13,39 +17,1239 @@ void cmd_switch_to_swd(void)
     swj_switch_to_swd();
 }
 
-int cmd_swd_read(uint8_t cmd_request, void *DataBuffer)
+int cmd_swd_set_timing(unsigned speed, unsigned idle_cycles, void *DataBuffer)
+{
+    uint32_t frequency;
+
+    if (!swd_set_timing(speed, idle_cycles))
+        return -1;
+    frequency = swd_measure_frequency();
+#if SWD_DMA
+    /* The DMA write engine follows, up to its own limit */
+    swd_dma_set_frequency(frequency);
+#endif
+    *(uint32_t *)DataBuffer = frequency;
+    return 0;
+}
+
+void cmd_swd_benchmark(void *DataBuffer)
+{
+    uint32_t *cycles = (uint32_t *)DataBuffer;
+
+    swd_benchmark_phy(&cycles[0], &cycles[1]);
+}
+
+int cmd_swd_benchmark_dma(void *DataBuffer)
+{
+#if SWD_DMA
+    *(uint32_t *)DataBuffer = swd_dma_benchmark();
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* WAIT retry policy: off by default, WAIT is returned as is */
+static unsigned cmd_wait_retries_max;
+static unsigned cmd_wait_backoff;
+/* Retries taken by the last transaction, and the backoff before the next one */
+static uint8_t cmd_wait_retries;
+static unsigned cmd_wait_idle;
+
+int cmd_swd_set_wait_retry(unsigned max_retries, unsigned backoff)
+{
+    if (max_retries > CMD_WAIT_RETRIES_MAX || backoff > CMD_WAIT_BACKOFF_MAX)
+        return -1;
+    cmd_wait_retries_max = max_retries;
+    cmd_wait_backoff = backoff;
+    return 0;
+}
+
+uint8_t cmd_swd_wait_retries(void)
+{
+    return cmd_wait_retries;
+}
+
+static void cmd_swd_wait_reset(void)
+{
+    cmd_wait_retries = 0;
+    cmd_wait_idle = cmd_wait_backoff;
+}
+
+/*
+ Called after a WAIT: clocks the backoff, doubling it every time.
+ Returns 0 once out of retries.
+ */
+static int cmd_swd_wait_backoff(void)
+{
+    if (cmd_wait_retries >= cmd_wait_retries_max)
+        return 0;
+    cmd_wait_retries++;
+    swd_idle_clocks(cmd_wait_idle);
+    cmd_wait_idle <<= 1;
+    if (cmd_wait_idle > CMD_WAIT_BACKOFF_MAX)
+        cmd_wait_idle = CMD_WAIT_BACKOFF_MAX;
+    return 1;
+}
+
+/* Start, APnDP, RnW, A[2:3], Parity, Stop, Park */
+static uint8_t cmd_swd_request(uint8_t cmd_request)
+{
+    return 0x81 | (cmd_request << 1) | (parity_even_4bit(cmd_request) << 5);
+}
+
+/* Maps a failed ACK to the status; anything but WAIT or FAULT is a protocol error */
+static int cmd_swd_status(swd_response_t response)
+{
+    if (response == SWD_RESPONSE_WAIT || response == SWD_RESPONSE_FAULT)
+        return response;
+    return CMD_STATUS_PROTOCOL_ERROR;
+}
+
+static int cmd_swd_read_plain(uint8_t cmd_request, void *DataBuffer)
 {
     swd_response_t response;
     int parity_ok = 0;
 
-    response = swd_request_response(0x81 | (cmd_request << 1) | (parity_even_4bit(cmd_request) << 5));
-    if (response == SWD_RESPONSE_OK) {
-        parity_ok = swd_data_read((uint32_t *)DataBuffer);
-    }
-    swd_turnaround(1);
-    swd_idle_cycles();
+    cmd_swd_wait_reset();
+    do {
+        response = swd_request_response(cmd_swd_request(cmd_request));
+        if (response == SWD_RESPONSE_OK) {
+            parity_ok = swd_data_read((uint32_t *)DataBuffer);
+        }
+        swd_turnaround(1);
+        swd_idle_cycles();
+    } while (response == SWD_RESPONSE_WAIT && cmd_swd_wait_backoff());
     
+    if (response != SWD_RESPONSE_OK)
+        return cmd_swd_status(response);
     if (!parity_ok)
-        return -1;
+        return CMD_STATUS_PARITY_ERROR;
+    return 0;
+}
+
+static int cmd_swd_write_plain(uint8_t cmd_request, const void *DataBuffer)
+{
+    swd_response_t response;
+
+    cmd_swd_wait_reset();
+    do {
+        response = swd_request_response(cmd_swd_request(cmd_request));
+        swd_turnaround(1);
+        if (response == SWD_RESPONSE_OK) {
+            swd_data_write(*(const uint32_t *)DataBuffer);
+        }
+        swd_idle_cycles();
+    } while (response == SWD_RESPONSE_WAIT && cmd_swd_wait_backoff());
+
     if (response == SWD_RESPONSE_OK)
         return 0;
-    return response;
+    return cmd_swd_status(response);
+}
+
+/* Recovery policies: off by default, failures are returned as is */
+static unsigned cmd_recovery;
+
+int cmd_swd_set_recovery(unsigned policies)
+{
+    if (policies & ~CMD_RECOVERY_ALL)
+        return -1;
+    cmd_recovery = policies;
+    return 0;
+}
+
+/*
+ Applies the recovery policies to a failed transaction:
+ - FAULT: clears the sticky flags via DP ABORT;
+ - protocol or parity error: line reset, then DPIDR read to get the DP going again.
+ Returns the status, with CMD_STATUS_RECOVERED if that went well.
+ */
+static int cmd_swd_recover(int status)
+{
+    const uint8_t saved_retries = cmd_wait_retries;
+    /* STKCMPCLR, STKERRCLR, WDERRCLR, ORUNERRCLR */
+    const uint32_t abort = 0x0000001E;
+    uint32_t idr;
+    int result = -1;
+
+    if (status == CMD_STATUS_FAULT && (cmd_recovery & CMD_RECOVERY_ABORT)) {
+        /* DP write, A=0 */
+        result = cmd_swd_write_plain(0x00, &abort);
+    } else if ((status == CMD_STATUS_PROTOCOL_ERROR || status == CMD_STATUS_PARITY_ERROR) && (cmd_recovery & CMD_RECOVERY_RESYNC)) {
+        swd_line_reset();
+        swd_idle_clocks(8);
+        /* DP read, A=0 */
+        result = cmd_swd_read_plain(CMD_REQUEST_RnW, &idr);
+    }
+    cmd_wait_retries = saved_retries;
+    return result == 0 ? (status | CMD_STATUS_RECOVERED) : status;
+}
+
+int cmd_swd_read(uint8_t cmd_request, void *DataBuffer)
+{
+    int result;
+
+    result = cmd_swd_read_plain(cmd_request, DataBuffer);
+    if (result)
+        result = cmd_swd_recover(result);
+    return result;
 }
 
 int cmd_swd_write(uint8_t cmd_request, const void *DataBuffer)
+{
+    int result;
+
+    result = cmd_swd_write_plain(cmd_request, DataBuffer);
+    if (result)
+        result = cmd_swd_recover(result);
+    return result;
+}
+
+#if SWD_DMA
+/*
+ Waits for the writes queued to the DMA engine and fills in their statuses.
+ Returns the end of the results: right past the first failed write, if any.
+ */
+static uint8_t *cmd_swd_batch_flush(uint8_t *queued, uint8_t *end, unsigned status_size, int *result)
 {
     swd_response_t response;
+    uint8_t *failed;
 
-    response = swd_request_response(0x81 | (cmd_request << 1) | (parity_even_4bit(cmd_request) << 5));
-    swd_turnaround(1);
-    if (response == SWD_RESPONSE_OK) {
-        swd_data_write(*(const uint32_t *)DataBuffer);
-    }
+    if (!queued)
+        return end;
+    failed = queued + swd_dma_end(&response) * status_size;
     swd_idle_cycles();
+    if (failed == end)
+        return end;
+    *result = cmd_swd_recover(cmd_swd_status(response));
+    *failed = (uint8_t)*result;
+    return failed + status_size;
+}
+#endif
 
-    if (response == SWD_RESPONSE_OK)
+#define CMD_CTRLSTAT_ORUNDETECT 0x00000001
+
+/*
+ Stream mode of cmd_swd_batch, for use with overrun detection enabled (CTRL/STAT.ORUNDETECT).
+ The ACKs are not acted upon: every op gets its data phase, as the DP then requires.
+ Reads produce their 4 data bytes only. The results end with a trailer:
+ the amount of ops done before the first failure (2 bytes), then CTRL/STAT read after the run (4 bytes),
+ once a RDBUFF read has waited for the last AP transaction to be over.
+ A protocol error ends the stream; *status is the first failure.
+ */
+static unsigned cmd_swd_stream(const uint8_t *ops, unsigned ops_length, unsigned flags, uint8_t *results, unsigned results_size, uint8_t *status)
+{
+    uint8_t *results_ptr = results;
+    unsigned completed = 0;
+    uint32_t ctrlstat = 0;
+    int result = 0;
+#if SWD_DMA
+    unsigned queued = 0;
+#endif
+
+    if (results_size < CMD_STREAM_TRAILER_SIZE) {
+        *status = CMD_STATUS_MALFORMED;
+        return 0;
+    }
+    results_size -= CMD_STREAM_TRAILER_SIZE;
+
+    while (ops_length && result != CMD_STATUS_PROTOCOL_ERROR) {
+        uint8_t cmd_request = ops[0];
+        swd_response_t response;
+        uint32_t data = 0;
+        int parity_ok = 1;
+
+        if (cmd_request & CMD_REQUEST_RnW) {
+            if (results_size < 4)
+                break;
+#if SWD_DMA
+            if (queued) {
+                unsigned acked = swd_dma_end(&response);
+                swd_idle_cycles();
+                if (!result) {
+                    completed += acked;
+                    if (acked < queued)
+                        result = cmd_swd_status(response);
+                }
+                queued = 0;
+            }
+#endif
+            ops += 1;
+            ops_length -= 1;
+            response = swd_request_response(cmd_swd_request(cmd_request));
+            parity_ok = swd_data_read(&data);
+            swd_turnaround(1);
+            results_ptr[0] = (uint8_t)(data >> 0);
+            results_ptr[1] = (uint8_t)(data >> 8);
+            results_ptr[2] = (uint8_t)(data >> 16);
+            results_ptr[3] = (uint8_t)(data >> 24);
+            results_ptr += 4;
+            results_size -= 4;
+        } else {
+            if (ops_length < 5) {
+                if (!result)
+                    result = CMD_STATUS_MALFORMED;
+                break;
+            }
+            data = ops[1] | (ops[2] << 8) | (ops[3] << 16) | ((uint32_t)ops[4] << 24);
+            ops += 5;
+            ops_length -= 5;
+#if SWD_DMA
+            if (flags & CMD_BATCH_DMA_WRITES) {
+                if (!queued)
+                    swd_dma_begin();
+                swd_dma_write(cmd_swd_request(cmd_request), data);
+                queued++;
+                continue;
+            }
+#endif
+            response = swd_request_response(cmd_swd_request(cmd_request));
+            swd_turnaround(1);
+            swd_data_write(data);
+        }
+        swd_idle_cycles();
+        if (!result) {
+            if (response != SWD_RESPONSE_OK) {
+                result = cmd_swd_status(response);
+            } else if (!parity_ok) {
+                result = CMD_STATUS_PARITY_ERROR;
+            } else {
+                completed++;
+            }
+        }
+    }
+#if SWD_DMA
+    if (queued) {
+        swd_response_t response;
+        unsigned acked = swd_dma_end(&response);
+        swd_idle_cycles();
+        if (!result) {
+            completed += acked;
+            if (acked < queued)
+                result = cmd_swd_status(response);
+        }
+    }
+#endif
+
+    /* DP read, A=4: CTRL/STAT is readable whatever the sticky flags are, and never WAITs */
+    if (cmd_swd_read_plain(CMD_REQUEST_RnW | 0x04, &ctrlstat) && !result)
+        result = CMD_STATUS_PROTOCOL_ERROR;
+    /*
+     DP read, A=C: RDBUFF WAITs while the last AP transaction is pending. The data phase follows
+     what the last op left ORUNDETECT at; with it on, a WAIT shows as an overrun. The ACK itself
+     does not matter: CTRL/STAT read again tells.
+     */
+    if (result != CMD_STATUS_PROTOCOL_ERROR) {
+        uint32_t rdbuff;
+
+        if (ctrlstat & CMD_CTRLSTAT_ORUNDETECT) {
+            swd_request_response(cmd_swd_request(CMD_REQUEST_RnW | 0x0C));
+            swd_data_read(&rdbuff);
+            swd_turnaround(1);
+            swd_idle_cycles();
+        } else {
+            cmd_swd_read_plain(CMD_REQUEST_RnW | 0x0C, &rdbuff);
+        }
+        if (cmd_swd_read_plain(CMD_REQUEST_RnW | 0x04, &ctrlstat) && !result)
+            result = CMD_STATUS_PROTOCOL_ERROR;
+    }
+    results_ptr[0] = (uint8_t)(completed >> 0);
+    results_ptr[1] = (uint8_t)(completed >> 8);
+    results_ptr[2] = (uint8_t)(ctrlstat >> 0);
+    results_ptr[3] = (uint8_t)(ctrlstat >> 8);
+    results_ptr[4] = (uint8_t)(ctrlstat >> 16);
+    results_ptr[5] = (uint8_t)(ctrlstat >> 24);
+    results_ptr += CMD_STREAM_TRAILER_SIZE;
+
+    *status = (uint8_t)result;
+    return results_ptr - results;
+}
+
+/*
+ Executes a list of encoded SWD transactions back to back.
+ Each op is a request byte (see CMD_REQUEST_*), followed by 4 data bytes for writes.
+ Each executed op produces a status byte, followed by 4 data bytes for reads.
+ Execution stops at the first op that fails; its status is also stored in *status.
+ With CMD_BATCH_REPORT_RETRIES, the status byte is followed by the WAIT retry count.
+ With CMD_BATCH_DMA_WRITES, runs of writes are streamed by the DMA engine;
+ this needs overrun detection enabled on the target.
+ With CMD_BATCH_STREAM, see cmd_swd_stream.
+ Returns the amount of result bytes produced.
+ */
+unsigned cmd_swd_batch(const uint8_t *ops, unsigned ops_length, unsigned flags, uint8_t *results, unsigned results_size, uint8_t *status)
+{
+    uint8_t *results_ptr = results;
+    const unsigned status_size = (flags & CMD_BATCH_REPORT_RETRIES) ? 2 : 1;
+    int result = 0;
+#if SWD_DMA
+    /* Results of the writes queued to the DMA engine */
+    uint8_t *queued_ptr = 0;
+#else
+    if (flags & CMD_BATCH_DMA_WRITES) {
+        *status = CMD_STATUS_MALFORMED;
+        return 0;
+    }
+#endif
+
+    if (flags & CMD_BATCH_STREAM)
+        return cmd_swd_stream(ops, ops_length, flags, results, results_size, status);
+
+    while (ops_length) {
+        uint8_t cmd_request = *ops++;
+        uint32_t data = 0;
+
+        ops_length--;
+        if (cmd_request & CMD_REQUEST_RnW) {
+#if SWD_DMA
+            results_ptr = cmd_swd_batch_flush(queued_ptr, results_ptr, status_size, &result);
+            queued_ptr = 0;
+            if (result)
+                break;
+#endif
+            if (results_size < status_size + 4)
+                break;
+            result = cmd_swd_read(cmd_request, &data);
+            *results_ptr++ = (uint8_t)result;
+            if (status_size > 1)
+                *results_ptr++ = cmd_wait_retries;
+            results_ptr[0] = (uint8_t)(data >> 0);
+            results_ptr[1] = (uint8_t)(data >> 8);
+            results_ptr[2] = (uint8_t)(data >> 16);
+            results_ptr[3] = (uint8_t)(data >> 24);
+            results_ptr += 4;
+            results_size -= status_size + 4;
+        } else {
+            if (results_size < status_size)
+                break;
+            if (ops_length < 4) {
+#if SWD_DMA
+                results_ptr = cmd_swd_batch_flush(queued_ptr, results_ptr, status_size, &result);
+                queued_ptr = 0;
+                if (result)
+                    break;
+#endif
+                result = CMD_STATUS_MALFORMED;
+                *results_ptr++ = (uint8_t)result;
+                if (status_size > 1)
+                    *results_ptr++ = 0;
+                break;
+            }
+            data = ops[0] | (ops[1] << 8) | (ops[2] << 16) | ((uint32_t)ops[3] << 24);
+            ops += 4;
+            ops_length -= 4;
+#if SWD_DMA
+            if (flags & CMD_BATCH_DMA_WRITES) {
+                if (!queued_ptr) {
+                    queued_ptr = results_ptr;
+                    swd_dma_begin();
+                }
+                *results_ptr++ = CMD_STATUS_OK;
+                if (status_size > 1)
+                    *results_ptr++ = 0;
+                results_size -= status_size;
+                if (!swd_dma_write(cmd_swd_request(cmd_request), data))
+                    break;
+                continue;
+            }
+#endif
+            result = cmd_swd_write(cmd_request, &data);
+            *results_ptr++ = (uint8_t)result;
+            if (status_size > 1)
+                *results_ptr++ = cmd_wait_retries;
+            results_size -= status_size;
+        }
+        if (result)
+            break;
+    }
+#if SWD_DMA
+    results_ptr = cmd_swd_batch_flush(queued_ptr, results_ptr, status_size, &result);
+#endif
+
+    *status = (uint8_t)result;
+    return results_ptr - results;
+}
+
+/* Registers used by the memory block commands, as CMD_REQUEST_* bits */
+#define CMD_DP_SELECT 0x08
+#define CMD_DP_RDBUFF 0x0C
+#define CMD_AP_CSW 0x01
+#define CMD_AP_TAR 0x05
+#define CMD_AP_DRW 0x0D
+
+#define CMD_CSW_SIZE 0x00000007
+#define CMD_CSW_ADDRINC_SINGLE 0x00000010
+#define CMD_CSW_ADDRINC_PACKED 0x00000020
+#define CMD_CSW_ADDRINC 0x00000030
+
+#define CMD_CTRLSTAT_STICKYERR 0x00000020
+
+/* TAR auto-increment is only guaranteed within 1KB */
+#define CMD_TAR_PAGE_SIZE 0x400
+
+/* Selects the AP and sets the access size and the auto-increment mode in CSW, leaving the rest as is */
+static int cmd_swd_mem_setup(uint8_t ap, unsigned size, uint32_t addrinc)
+{
+    uint32_t select = (uint32_t)ap << 24;
+    uint32_t csw;
+    int result;
+
+    result = cmd_swd_write(CMD_DP_SELECT, &select);
+    if (!result)
+        result = cmd_swd_read(CMD_AP_CSW | CMD_REQUEST_RnW, &csw);
+    if (!result)
+        result = cmd_swd_read(CMD_DP_RDBUFF | CMD_REQUEST_RnW, &csw);
+    if (!result) {
+        csw = (csw & ~(CMD_CSW_ADDRINC | CMD_CSW_SIZE)) | addrinc | size;
+        result = cmd_swd_write(CMD_AP_CSW, &csw);
+    }
+    return result;
+}
+
+/* State of the block read or write being streamed */
+static uint32_t cmd_mem_address;
+static unsigned cmd_mem_remaining;
+static unsigned cmd_mem_size;
+static unsigned cmd_mem_valid;
+static int cmd_mem_status;
+static uint8_t cmd_mem_trailer[CMD_MEM_TRAILER_SIZE];
+static unsigned cmd_mem_trailer_sent;
+
+/*
+ Starts a block read. The parameters are: AP (8 bits), access size (8 bits, CSW encoding: 0..2),
+ length in bytes (16 bits), start address (32 bits); the address and the length are size aligned.
+ Returns the status; if OK, *response_length is set to the length of the data plus the trailer.
+ */
+int cmd_swd_mem_read_begin(const uint8_t *params, unsigned params_length, uint16_t *response_length)
+{
+    unsigned size;
+    unsigned length;
+    uint32_t address;
+    int result;
+
+    if (params_length != CMD_MEM_PARAMS_SIZE)
+        return CMD_STATUS_MALFORMED;
+    size = params[1];
+    length = params[2] | (params[3] << 8);
+    address = params[4] | (params[5] << 8) | (params[6] << 16) | ((uint32_t)params[7] << 24);
+    if (size > 2 || length == 0 || length > CMD_MEM_BLOCK_MAX || ((address | length) & ((1 << size) - 1)))
+        return CMD_STATUS_MALFORMED;
+
+    result = cmd_swd_mem_setup(params[0], size, CMD_CSW_ADDRINC_SINGLE);
+    if (result)
+        return result;
+    cmd_mem_address = address;
+    cmd_mem_remaining = length;
+    cmd_mem_size = size;
+    cmd_mem_valid = 0;
+    cmd_mem_status = 0;
+    cmd_mem_trailer_sent = 0;
+    *response_length = length + CMD_MEM_TRAILER_SIZE;
+    return 0;
+}
+
+/*
+ The block read output and the block write input live in the USB packet memory:
+ 16-bit halfwords, each taking the low half of a 32-bit word.
+ */
+static volatile uint32_t *cmd_mem_out;
+static uint32_t cmd_mem_out_bits;
+static unsigned cmd_mem_out_count;
+
+/* Appends count bytes of the value to the output, least significant first */
+static void cmd_swd_mem_out(uint32_t bytes, unsigned count)
+{
+    if (cmd_mem_out_count == 0) {
+        while (count >= 2) {
+            *cmd_mem_out++ = bytes & 0xFFFF;
+            bytes >>= 16;
+            count -= 2;
+        }
+    }
+    while (count--) {
+        cmd_mem_out_bits |= (bytes & 0xFF) << (cmd_mem_out_count * 8);
+        bytes >>= 8;
+        if (++cmd_mem_out_count == 2) {
+            *cmd_mem_out++ = cmd_mem_out_bits;
+            cmd_mem_out_bits = 0;
+            cmd_mem_out_count = 0;
+        }
+    }
+}
+
+/*
+ Reads count elements from the current address on, all within one TAR page:
+ TAR, then the DRW reads, each returning the previous one; the last one comes from RDBUFF.
+ Returns the status; *done is the amount of elements output.
+ */
+static int cmd_swd_mem_read_run(unsigned count, unsigned *done)
+{
+    uint32_t address = cmd_mem_address;
+    uint32_t value;
+    unsigned n;
+    int result;
+
+    *done = 0;
+    result = cmd_swd_write(CMD_AP_TAR, &address);
+    if (!result)
+        result = cmd_swd_read(CMD_AP_DRW | CMD_REQUEST_RnW, &value);
+    for (n = 1; !result && n <= count; ++n) {
+        result = cmd_swd_read((n < count ? CMD_AP_DRW : CMD_DP_RDBUFF) | CMD_REQUEST_RnW, &value);
+        if (result)
+            break;
+        /* Byte lanes follow the address */
+        cmd_swd_mem_out(value >> ((address & 3) * 8), 1 << cmd_mem_size);
+        address += 1 << cmd_mem_size;
+        *done = n;
+    }
+    return result;
+}
+
+/*
+ Produces the next part of the block read response into the packet memory: the data, then the trailer
+ (status, 0, amount of valid data bytes: 16 bits). After a failure the data is padded with zeros.
+ Returns the amount of bytes stored; size is a multiple of 4.
+ */
+unsigned cmd_swd_mem_read_produce(volatile uint32_t *buffer, unsigned size)
+{
+    unsigned produced = 0;
+
+    cmd_mem_out = buffer;
+    while (size && cmd_mem_remaining) {
+        unsigned run = CMD_TAR_PAGE_SIZE - (cmd_mem_address & (CMD_TAR_PAGE_SIZE - 1));
+        unsigned done;
+
+        if (run > cmd_mem_remaining)
+            run = cmd_mem_remaining;
+        if (run > size)
+            run = size;
+        if (cmd_mem_status) {
+            for (done = 0; done < run; ++done)
+                cmd_swd_mem_out(0, 1);
+        } else {
+            cmd_mem_status = cmd_swd_mem_read_run(run >> cmd_mem_size, &done);
+            done <<= cmd_mem_size;
+            cmd_mem_valid += done;
+        }
+        produced += done;
+        size -= done;
+        cmd_mem_remaining -= done;
+        cmd_mem_address += done;
+    }
+
+    if (!cmd_mem_remaining && cmd_mem_trailer_sent == 0) {
+        cmd_mem_trailer[0] = (uint8_t)cmd_mem_status;
+        cmd_mem_trailer[1] = 0;
+        cmd_mem_trailer[2] = (uint8_t)(cmd_mem_valid >> 0);
+        cmd_mem_trailer[3] = (uint8_t)(cmd_mem_valid >> 8);
+    }
+    while (size && !cmd_mem_remaining && cmd_mem_trailer_sent < CMD_MEM_TRAILER_SIZE) {
+        cmd_swd_mem_out(cmd_mem_trailer[cmd_mem_trailer_sent++], 1);
+        produced++;
+        size--;
+    }
+    /* An odd byte can only be left at the very end */
+    if (cmd_mem_out_count) {
+        *cmd_mem_out++ = cmd_mem_out_bits;
+        cmd_mem_out_bits = 0;
+        cmd_mem_out_count = 0;
+    }
+    return produced;
+}
+
+/* Block write: address increment per DRW write, and the DRW value being assembled */
+static unsigned cmd_mem_step;
+static uint32_t cmd_mem_partial;
+static unsigned cmd_mem_partial_count;
+
+/*
+ Starts a block write. The parameters are as for the block read, with CMD_MEM_PACKED or'ed
+ into the size for packed byte/halfword transfers; these need a word aligned address and length.
+ The data follows the parameters. Errors are reported by cmd_swd_mem_write_end().
+ */
+void cmd_swd_mem_write_begin(const uint8_t *params, unsigned payload_length)
+{
+    unsigned size = params[1] & ~CMD_MEM_PACKED;
+    unsigned packed = params[1] & CMD_MEM_PACKED;
+    unsigned length = params[2] | (params[3] << 8);
+    uint32_t address = params[4] | (params[5] << 8) | (params[6] << 16) | ((uint32_t)params[7] << 24);
+
+    cmd_mem_address = address;
+    cmd_mem_remaining = length;
+    cmd_mem_size = size;
+    cmd_mem_valid = 0;
+    cmd_mem_partial = 0;
+    cmd_mem_partial_count = 0;
+    if (size > 2 || length == 0 || length > CMD_MEM_BLOCK_MAX || length != payload_length - CMD_MEM_PARAMS_SIZE ||
+        ((address | length) & ((packed ? 4 : 1 << size) - 1)) || (packed && size == 2)) {
+        cmd_mem_status = CMD_STATUS_MALFORMED;
+        return;
+    }
+    cmd_mem_step = packed ? 4 : 1 << size;
+    cmd_mem_status = cmd_swd_mem_setup(params[0], size, packed ? CMD_CSW_ADDRINC_PACKED : CMD_CSW_ADDRINC_SINGLE);
+}
+
+static void cmd_swd_mem_write_element(uint32_t value)
+{
+    /* TAR on the first write and at every page boundary */
+    if (cmd_mem_valid == 0 || (cmd_mem_address & (CMD_TAR_PAGE_SIZE - 1)) == 0)
+        cmd_mem_status = cmd_swd_write(CMD_AP_TAR, &cmd_mem_address);
+    if (!cmd_mem_status) {
+        /* Byte lanes follow the address */
+        value <<= (cmd_mem_address & 3) * 8;
+        cmd_mem_status = cmd_swd_write(CMD_AP_DRW, &value);
+    }
+    if (!cmd_mem_status)
+        cmd_mem_valid += cmd_mem_step;
+    else if ((cmd_mem_status & ~CMD_STATUS_RECOVERED) == CMD_STATUS_FAULT && cmd_mem_valid)
+        /* DRW writes are posted: the FAULT is that of the previous write */
+        cmd_mem_valid -= cmd_mem_step;
+    cmd_mem_address += cmd_mem_step;
+}
+
+/*
+ Appends count bytes of the value to the data, least significant first; after a failure the rest
+ is dropped, as is anything past the length of the block.
+ */
+static void cmd_swd_mem_write_bytes(uint32_t bytes, unsigned count)
+{
+    while (count-- && cmd_mem_remaining && !cmd_mem_status) {
+        cmd_mem_remaining--;
+        cmd_mem_partial |= (bytes & 0xFF) << (cmd_mem_partial_count * 8);
+        bytes >>= 8;
+        if (++cmd_mem_partial_count == cmd_mem_step) {
+            cmd_swd_mem_write_element(cmd_mem_partial);
+            cmd_mem_partial = 0;
+            cmd_mem_partial_count = 0;
+        }
+    }
+}
+
+/* Writes the data as it arrives */
+void cmd_swd_mem_write_consume(const uint8_t *data, unsigned length)
+{
+    while (length--)
+        cmd_swd_mem_write_bytes(*data++, 1);
+}
+
+/* Same, with the data read in place from the packet memory */
+void cmd_swd_mem_write_consume_pma(const volatile uint32_t *halfwords, unsigned length)
+{
+    while (length >= 2) {
+        cmd_swd_mem_write_bytes(*halfwords++, 2);
+        length -= 2;
+    }
+    if (length)
+        cmd_swd_mem_write_bytes(*halfwords, 1);
+}
+
+/*
+ Completes the block write: CTRL/STAT tells whether the last posted write went through,
+ once a RDBUFF read has waited for it to be over.
+ The result is the amount of bytes written (32 bits). Returns the result length.
+ */
+unsigned cmd_swd_mem_write_end(uint8_t *results, uint8_t *status)
+{
+    uint32_t ctrlstat;
+    uint32_t rdbuff;
+    int result = cmd_mem_status;
+    int drained;
+
+    if (!result) {
+        /* WAITs, as the retry policy allows, until the write is over; FAULTs if a sticky flag is set */
+        drained = cmd_swd_read_plain(CMD_DP_RDBUFF | CMD_REQUEST_RnW, &rdbuff);
+        if (drained && drained != CMD_STATUS_FAULT) {
+            result = cmd_swd_recover(drained);
+        } else {
+            /* DP read, A=4 */
+            result = cmd_swd_read(CMD_REQUEST_RnW | 0x04, &ctrlstat);
+            if (!result && (ctrlstat & CMD_CTRLSTAT_STICKYERR)) {
+                cmd_mem_valid -= cmd_mem_step;
+                result = cmd_swd_recover(CMD_STATUS_FAULT);
+            } else if (!result && drained) {
+                result = cmd_swd_recover(drained);
+            }
+        }
+    }
+    results[0] = (uint8_t)(cmd_mem_valid >> 0);
+    results[1] = (uint8_t)(cmd_mem_valid >> 8);
+    results[2] = (uint8_t)(cmd_mem_valid >> 16);
+    results[3] = (uint8_t)(cmd_mem_valid >> 24);
+    *status = (uint8_t)result;
+    return 4;
+}
+
+/* STM32F1 FPEC registers and bits, as laid out in software/armprobe/stm32f1.py */
+#define CMD_FLASH_SR 0x0C
+#define CMD_FLASH_CR 0x10
+#define CMD_FLASH_AR 0x14
+
+#define CMD_FLASH_SR_BSY 0x00000001
+#define CMD_FLASH_SR_PGERR 0x00000004
+#define CMD_FLASH_SR_WRPRTERR 0x00000010
+#define CMD_FLASH_SR_EOP 0x00000020
+#define CMD_FLASH_CR_PG 0x00000001
+#define CMD_FLASH_CR_PER 0x00000002
+#define CMD_FLASH_CR_STRT 0x00000040
+
+/* Upper bounds of the FPEC operations; the datasheet gives 70us per halfword and 40ms per page */
+#define CMD_FLASH_PROGRAM_TIMEOUT_MS 5
+#define CMD_FLASH_ERASE_TIMEOUT_MS 100
+
+/* State of the flash programming being streamed */
+static uint8_t cmd_flash_ap;
+static uint32_t cmd_flash_base;
+static uint32_t cmd_flash_start;
+static uint32_t cmd_flash_address;
+static unsigned cmd_flash_page_bits;
+static unsigned cmd_flash_erase;
+static unsigned cmd_flash_pages;
+static unsigned cmd_flash_remaining;
+static int cmd_flash_status;
+static uint8_t cmd_flash_page_status[CMD_MEM_BLOCK_MAX / CMD_FLASH_PAGE_MIN];
+static uint32_t cmd_flash_partial;
+static unsigned cmd_flash_partial_count;
+
+static int cmd_flash_write_reg(uint32_t offset, uint32_t value)
+{
+    uint32_t address = cmd_flash_base + offset;
+    int result;
+
+    result = cmd_swd_write(CMD_AP_TAR, &address);
+    if (!result)
+        result = cmd_swd_write(CMD_AP_DRW, &value);
+    return result;
+}
+
+/*
+ Polls SR until BSY clears. Gives CMD_STATUS_TIMEOUT if it does not within timeout_ms,
+ CMD_STATUS_FLASH_ERROR if the operation ended with PGERR or WRPRTERR.
+ SR is read with whatever access size CSW holds: the flags all live in the low halfword.
+ */
+static int cmd_flash_wait(unsigned timeout_ms)
+{
+    const uint32_t timeout = timeout_ms * (SystemCoreClock / 1000);
+    uint32_t address = cmd_flash_base + CMD_FLASH_SR;
+    uint32_t sr;
+    uint32_t start;
+    int result;
+
+    swd_cycles_enable();
+    start = DWT_CYCCNT;
+    result = cmd_swd_write(CMD_AP_TAR, &address);
+    for (;;) {
+        if (!result)
+            result = cmd_swd_read(CMD_AP_DRW | CMD_REQUEST_RnW, &sr);
+        if (!result)
+            result = cmd_swd_read(CMD_DP_RDBUFF | CMD_REQUEST_RnW, &sr);
+        if (result)
+            return result;
+        if (!(sr & CMD_FLASH_SR_BSY))
+            break;
+        if (DWT_CYCCNT - start >= timeout)
+            return CMD_STATUS_TIMEOUT;
+    }
+    if (sr & (CMD_FLASH_SR_PGERR | CMD_FLASH_SR_WRPRTERR))
+        return CMD_STATUS_FLASH_ERROR;
+    return 0;
+}
+
+/*
+ Prepares the page the current address starts: clears the SR flags, erases the page if asked to,
+ sets PG and leaves CSW at halfword size for the data. The registers are written with word accesses.
+ */
+static int cmd_flash_page_begin(void)
+{
+    int result;
+
+    result = cmd_swd_mem_setup(cmd_flash_ap, 2, 0);
+    if (!result)
+        result = cmd_flash_write_reg(CMD_FLASH_SR, CMD_FLASH_SR_EOP | CMD_FLASH_SR_WRPRTERR | CMD_FLASH_SR_PGERR);
+    if (!result && cmd_flash_erase) {
+        result = cmd_flash_write_reg(CMD_FLASH_CR, CMD_FLASH_CR_PER);
+        if (!result)
+            result = cmd_flash_write_reg(CMD_FLASH_AR, cmd_flash_address);
+        if (!result)
+            result = cmd_flash_write_reg(CMD_FLASH_CR, CMD_FLASH_CR_PER | CMD_FLASH_CR_STRT);
+        if (!result)
+            result = cmd_flash_wait(CMD_FLASH_ERASE_TIMEOUT_MS);
+    }
+    if (!result)
+        result = cmd_flash_write_reg(CMD_FLASH_CR, CMD_FLASH_CR_PG);
+    if (!result)
+        result = cmd_swd_mem_setup(cmd_flash_ap, 1, 0);
+    return result;
+}
+
+/* Programs the halfword at the current address; a failure drops the rest of the page */
+static void cmd_flash_program_halfword(uint32_t value)
+{
+    const unsigned page = (cmd_flash_address - cmd_flash_start) >> cmd_flash_page_bits;
+    int result;
+
+    if (page >= cmd_flash_pages)
+        return;
+    result = cmd_flash_page_status[page];
+    if (!result && (cmd_flash_address & ((1 << cmd_flash_page_bits) - 1)) == 0)
+        result = cmd_flash_page_begin();
+    /* A freshly erased page already reads as ones */
+    if (!result && !(cmd_flash_erase && value == 0xFFFF)) {
+        uint32_t address = cmd_flash_address;
+
+        result = cmd_swd_write(CMD_AP_TAR, &address);
+        if (!result) {
+            /* Byte lanes follow the address */
+            value <<= (address & 2) * 8;
+            result = cmd_swd_write(CMD_AP_DRW, &value);
+        }
+        if (!result)
+            result = cmd_flash_wait(CMD_FLASH_PROGRAM_TIMEOUT_MS);
+    }
+    cmd_flash_page_status[page] = (uint8_t)result;
+    if (result && !cmd_flash_status)
+        cmd_flash_status = result;
+    cmd_flash_address += 2;
+}
+
+/*
+ Starts programming STM32F1 flash. The parameters are: AP (8 bits), page size as a power of 2 (8 bits;
+ CMD_FLASH_ERASE or'ed in to erase each page first), length in bytes (16 bits), page aligned start
+ address (32 bits), FPEC base address (32 bits). The data follows the parameters, and is programmed
+ halfword by halfword as it arrives, each page on its own: a failure only drops the rest of its page.
+ Errors are reported by cmd_flash_program_end().
+ */
+void cmd_flash_program_begin(const uint8_t *params, unsigned payload_length)
+{
+    unsigned page_bits = params[1] & ~CMD_FLASH_ERASE;
+    unsigned length = params[2] | (params[3] << 8);
+    uint32_t address = params[4] | (params[5] << 8) | (params[6] << 16) | ((uint32_t)params[7] << 24);
+    unsigned page;
+
+    cmd_flash_ap = params[0];
+    cmd_flash_base = params[8] | (params[9] << 8) | (params[10] << 16) | ((uint32_t)params[11] << 24);
+    cmd_flash_start = address;
+    cmd_flash_address = address;
+    cmd_flash_page_bits = page_bits;
+    cmd_flash_erase = params[1] & CMD_FLASH_ERASE;
+    cmd_flash_pages = 0;
+    cmd_flash_remaining = 0;
+    cmd_flash_status = 0;
+    cmd_flash_partial = 0;
+    cmd_flash_partial_count = 0;
+    if (page_bits > 15 || (1u << page_bits) < CMD_FLASH_PAGE_MIN || length == 0 || length > CMD_MEM_BLOCK_MAX ||
+        length != payload_length - CMD_FLASH_PARAMS_SIZE || (length & 1) || (address & ((1 << page_bits) - 1))) {
+        cmd_flash_status = CMD_STATUS_MALFORMED;
+        return;
+    }
+    cmd_flash_pages = (length + (1 << page_bits) - 1) >> page_bits;
+    cmd_flash_remaining = length;
+    for (page = 0; page < cmd_flash_pages; ++page)
+        cmd_flash_page_status[page] = 0;
+}
+
+/* Appends count bytes of the value to the data, least significant first; anything past the length is dropped */
+static void cmd_flash_program_bytes(uint32_t bytes, unsigned count)
+{
+    while (count-- && cmd_flash_remaining) {
+        cmd_flash_remaining--;
+        cmd_flash_partial |= (bytes & 0xFF) << (cmd_flash_partial_count * 8);
+        bytes >>= 8;
+        if (++cmd_flash_partial_count == 2) {
+            cmd_flash_program_halfword(cmd_flash_partial);
+            cmd_flash_partial = 0;
+            cmd_flash_partial_count = 0;
+        }
+    }
+}
+
+/* Programs the data as it arrives */
+void cmd_flash_program_consume(const uint8_t *data, unsigned length)
+{
+    while (length--)
+        cmd_flash_program_bytes(*data++, 1);
+}
+
+/* Same, with the data read in place from the packet memory */
+void cmd_flash_program_consume_pma(const volatile uint32_t *halfwords, unsigned length)
+{
+    while (length >= 2) {
+        cmd_flash_program_bytes(*halfwords++, 2);
+        length -= 2;
+    }
+    if (length)
+        cmd_flash_program_bytes(*halfwords, 1);
+}
+
+/*
+ Completes the flash programming: clears PG, leaving the FPEC idle.
+ The results are the status of every page (8 bits each). Returns the results length.
+ */
+unsigned cmd_flash_program_end(uint8_t *results, uint8_t *status)
+{
+    unsigned page;
+    int result;
+
+    if (cmd_flash_status == CMD_STATUS_MALFORMED) {
+        *status = CMD_STATUS_MALFORMED;
+        return 0;
+    }
+    result = cmd_swd_mem_setup(cmd_flash_ap, 2, 0);
+    if (!result)
+        result = cmd_flash_write_reg(CMD_FLASH_CR, 0);
+    if (result && !cmd_flash_status)
+        cmd_flash_status = result;
+    for (page = 0; page < cmd_flash_pages; ++page)
+        results[page] = cmd_flash_page_status[page];
+    *status = (uint8_t)cmd_flash_status;
+    return cmd_flash_pages;
+}
+
+/*
+ Polls a word of memory until (value & mask) == expected. The parameters are: AP (8 bits), 0 (8 bits),
+ timeout in milliseconds (16 bits), address, mask, expected value, iteration limit (32 bits each);
+ a zero timeout or limit means none, but one of them is required. Every iteration is one DRW read fetched from RDBUFF,
+ so registers with read side effects see exactly one read per iteration.
+ The results are the last value read and the iteration count (32 bits each).
+ Gives CMD_STATUS_TIMEOUT if the value did not match in time. Returns the results length.
+ */
+unsigned cmd_swd_poll_mem(const uint8_t *params, unsigned params_length, uint8_t *results, uint8_t *status)
+{
+    const uint32_t cycles_per_ms = SystemCoreClock / 1000;
+    unsigned timeout;
+    uint32_t address;
+    uint32_t mask;
+    uint32_t expected;
+    uint32_t limit;
+    uint32_t value = 0;
+    uint32_t iterations = 0;
+    uint32_t start;
+    unsigned elapsed = 0;
+    int result;
+
+    if (params_length != CMD_POLL_PARAMS_SIZE) {
+        *status = CMD_STATUS_MALFORMED;
+        return 0;
+    }
+    timeout = params[2] | (params[3] << 8);
+    address = params[4] | (params[5] << 8) | (params[6] << 16) | ((uint32_t)params[7] << 24);
+    mask = params[8] | (params[9] << 8) | (params[10] << 16) | ((uint32_t)params[11] << 24);
+    expected = params[12] | (params[13] << 8) | (params[14] << 16) | ((uint32_t)params[15] << 24);
+    limit = params[16] | (params[17] << 8) | (params[18] << 16) | ((uint32_t)params[19] << 24);
+    if ((address & 3) || (!timeout && !limit)) {
+        *status = CMD_STATUS_MALFORMED;
+        return 0;
+    }
+
+    result = cmd_swd_mem_setup(params[0], 2, 0);
+    if (!result)
+        result = cmd_swd_write(CMD_AP_TAR, &address);
+    swd_cycles_enable();
+    start = DWT_CYCCNT;
+    while (!result) {
+        result = cmd_swd_read(CMD_AP_DRW | CMD_REQUEST_RnW, &value);
+        if (!result)
+            result = cmd_swd_read(CMD_DP_RDBUFF | CMD_REQUEST_RnW, &value);
+        if (result)
+            break;
+        iterations++;
+        if ((value & mask) == expected)
+            break;
+        /* Milliseconds are counted as they pass, so long timeouts do not overflow the cycle counter */
+        while (DWT_CYCCNT - start >= cycles_per_ms) {
+            start += cycles_per_ms;
+            elapsed++;
+        }
+        if ((timeout && elapsed >= timeout) || (limit && iterations >= limit))
+            result = CMD_STATUS_TIMEOUT;
+    }
+    results[0] = (uint8_t)(value >> 0);
+    results[1] = (uint8_t)(value >> 8);
+    results[2] = (uint8_t)(value >> 16);
+    results[3] = (uint8_t)(value >> 24);
+    results[4] = (uint8_t)(iterations >> 0);
+    results[5] = (uint8_t)(iterations >> 8);
+    results[6] = (uint8_t)(iterations >> 16);
+    results[7] = (uint8_t)(iterations >> 24);
+    *status = (uint8_t)result;
+    return CMD_POLL_RESULTS_SIZE;
+}
+
+/* Memory sampling: sampling interval in CPU cycles (0: stopped), time of the last sample */
+static uint32_t cmd_sample_interval;
+static uint32_t cmd_sample_last;
+static int cmd_sample_status;
+/* Halt watch: polling interval in CPU cycles (0: stopped), time of the last poll */
+static uint32_t cmd_watch_interval;
+static uint32_t cmd_watch_last;
+/* DHCSR state last reported, if any */
+static uint32_t cmd_watch_state;
+static int cmd_watch_reported;
+
+/* Moves the time of the last poll on, keeping the pace even if this one was late */
+static void cmd_poll_advance(uint32_t *last, uint32_t interval, uint32_t timestamp)
+{
+    *last += interval;
+    if (timestamp - *last >= interval)
+        *last = timestamp;
+}
+
+/*
+ Starts sampling a word of memory periodically. The parameters are: AP (8 bits), 0 (8 bits),
+ interval in microseconds (16 bits), address (32 bits); a zero interval stops sampling.
+ The probe owns the AP while sampling: SELECT, CSW and TAR are set up once, so the host must not
+ access the target until it stops sampling; watching for halts stops.
+ Stopping returns the failure which stopped sampling, if any.
+ */
+int cmd_swd_sample_begin(const uint8_t *params, unsigned params_length)
+{
+    unsigned interval;
+    uint32_t address;
+    int result;
+
+    if (params_length != CMD_MEM_PARAMS_SIZE)
+        return CMD_STATUS_MALFORMED;
+    interval = params[2] | (params[3] << 8);
+    address = params[4] | (params[5] << 8) | (params[6] << 16) | ((uint32_t)params[7] << 24);
+    if (interval == 0) {
+        result = cmd_sample_status;
+        cmd_sample_interval = 0;
+        cmd_sample_status = 0;
+        return result;
+    }
+    if (address & 3)
+        return CMD_STATUS_MALFORMED;
+
+    cmd_sample_interval = 0;
+    cmd_watch_interval = 0;
+    result = cmd_swd_mem_setup(params[0], 2, 0);
+    if (!result)
+        result = cmd_swd_write(CMD_AP_TAR, &address);
+    if (result)
+        return result;
+    swd_cycles_enable();
+    cmd_sample_status = 0;
+    cmd_sample_interval = interval * (SystemCoreClock / 1000000);
+    cmd_sample_last = DWT_CYCCNT - cmd_sample_interval;
+    return 0;
+}
+
+int cmd_swd_sample_due(void)
+{
+    return cmd_sample_interval && DWT_CYCCNT - cmd_sample_last >= cmd_sample_interval;
+}
+
+/*
+ Takes a sample into the record. A failure stops sampling.
+ Returns nonzero if the record was filled.
+ */
+int cmd_swd_sample(uint8_t *record)
+{
+    uint32_t timestamp = DWT_CYCCNT;
+    uint32_t value;
+    int result;
+
+    if (!cmd_sample_interval)
+        return 0;
+    cmd_poll_advance(&cmd_sample_last, cmd_sample_interval, timestamp);
+    result = cmd_swd_read(CMD_AP_DRW | CMD_REQUEST_RnW, &value);
+    if (!result)
+        result = cmd_swd_read(CMD_DP_RDBUFF | CMD_REQUEST_RnW, &value);
+    if (result) {
+        cmd_sample_status = result;
+        cmd_sample_interval = 0;
+        return 0;
+    }
+    record[0] = (uint8_t)(timestamp >> 0);
+    record[1] = (uint8_t)(timestamp >> 8);
+    record[2] = (uint8_t)(timestamp >> 16);
+    record[3] = (uint8_t)(timestamp >> 24);
+    record[4] = (uint8_t)(value >> 0);
+    record[5] = (uint8_t)(value >> 8);
+    record[6] = (uint8_t)(value >> 16);
+    record[7] = (uint8_t)(value >> 24);
+    return 1;
+}
+
+#define CMD_DHCSR_S_HALT 0x00020000
+#define CMD_DHCSR_S_LOCKUP 0x00080000
+#define CMD_DHCSR_S_RESET_ST 0x02000000
+#define CMD_DHCSR_EVENTS (CMD_DHCSR_S_HALT | CMD_DHCSR_S_LOCKUP | CMD_DHCSR_S_RESET_ST)
+
+/*
+ Starts watching the DHCSR of a Cortex-M core for halts, lockups and resets while it runs.
+ The parameters are the same as for sampling, the address being the one of DHCSR;
+ a zero interval stops watching. As with sampling, the probe owns the AP, and sampling stops.
+ */
+int cmd_swd_watch_begin(const uint8_t *params, unsigned params_length)
+{
+    unsigned interval;
+    uint32_t address;
+    int result;
+
+    if (params_length != CMD_MEM_PARAMS_SIZE)
+        return CMD_STATUS_MALFORMED;
+    interval = params[2] | (params[3] << 8);
+    address = params[4] | (params[5] << 8) | (params[6] << 16) | ((uint32_t)params[7] << 24);
+    if (interval == 0) {
+        cmd_watch_interval = 0;
         return 0;
-    return response;
+    }
+    if (address & 3)
+        return CMD_STATUS_MALFORMED;
+
+    cmd_watch_interval = 0;
+    cmd_sample_interval = 0;
+    result = cmd_swd_mem_setup(params[0], 2, 0);
+    if (!result)
+        result = cmd_swd_write(CMD_AP_TAR, &address);
+    if (result)
+        return result;
+    swd_cycles_enable();
+    cmd_watch_reported = 0;
+    cmd_watch_interval = interval * (SystemCoreClock / 1000000);
+    cmd_watch_last = DWT_CYCCNT - cmd_watch_interval;
+    return 0;
+}
+
+int cmd_swd_watch_due(void)
+{
+    return cmd_watch_interval && DWT_CYCCNT - cmd_watch_last >= cmd_watch_interval;
+}
+
+/*
+ Polls DHCSR. The first poll always reports the state; then an event is reported whenever
+ S_HALT or S_LOCKUP change, or S_RESET_ST is seen. A failure is reported too, and stops watching.
+ Returns nonzero if the event was filled.
+ */
+int cmd_swd_watch(uint8_t *event)
+{
+    uint32_t dhcsr;
+    int result;
+
+    if (!cmd_watch_interval)
+        return 0;
+    cmd_poll_advance(&cmd_watch_last, cmd_watch_interval, DWT_CYCCNT);
+    result = cmd_swd_read(CMD_AP_DRW | CMD_REQUEST_RnW, &dhcsr);
+    if (!result)
+        result = cmd_swd_read(CMD_DP_RDBUFF | CMD_REQUEST_RnW, &dhcsr);
+    if (result) {
+        cmd_watch_interval = 0;
+        dhcsr = 0;
+    } else {
+        const uint32_t state = dhcsr & CMD_DHCSR_EVENTS;
+        if (cmd_watch_reported && state == cmd_watch_state && !(state & CMD_DHCSR_S_RESET_ST))
+            return 0;
+        cmd_watch_state = state;
+        cmd_watch_reported = 1;
+    }
+    event[0] = (uint8_t)result;
+    event[1] = 0;
+    event[2] = 0;
+    event[3] = 0;
+    event[4] = (uint8_t)(dhcsr >> 0);
+    event[5] = (uint8_t)(dhcsr >> 8);
+    event[6] = (uint8_t)(dhcsr >> 16);
+    event[7] = (uint8_t)(dhcsr >> 24);
+    return 1;
 }
 
 void cmd_gpio_configure(int enabled)
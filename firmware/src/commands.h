@@ -0,0 +1,97 @@
+#ifndef __commands_h
+#define __commands_h
+
+#include <stdint.h>
+
+/* Request encoding shared by all SWD commands */
+#define CMD_REQUEST_APnDP 0x01
+#define CMD_REQUEST_RnW 0x02
+#define CMD_REQUEST_A32 0x0C
+
+/* Status codes returned by the SWD commands */
+#define CMD_STATUS_OK 0x00
+#define CMD_STATUS_WAIT 0x02
+#define CMD_STATUS_FAULT 0x04
+#define CMD_STATUS_PROTOCOL_ERROR 0x07
+#define CMD_STATUS_PARITY_ERROR 0x08
+#define CMD_STATUS_TIMEOUT 0x10
+#define CMD_STATUS_FLASH_ERROR 0x20
+#define CMD_STATUS_MALFORMED 0xFE
+/* Or'ed into a failure status once the recovery policy has cleaned up after it */
+#define CMD_STATUS_RECOVERED 0x40
+
+/* Recovery policies */
+#define CMD_RECOVERY_ABORT 0x01
+#define CMD_RECOVERY_RESYNC 0x02
+#define CMD_RECOVERY_ALL (CMD_RECOVERY_ABORT | CMD_RECOVERY_RESYNC)
+
+/* Batch flags */
+#define CMD_BATCH_DMA_WRITES 0x01
+#define CMD_BATCH_REPORT_RETRIES 0x02
+#define CMD_BATCH_STREAM 0x04
+
+/* Stream mode trailer: ops done before the first failure (16 bits), CTRL/STAT (32 bits) */
+#define CMD_STREAM_TRAILER_SIZE 6
+
+/* WAIT retry limits */
+#define CMD_WAIT_RETRIES_MAX 255
+#define CMD_WAIT_BACKOFF_MAX 1024
+
+void cmd_swd_enable(int enabled);
+void cmd_switch_to_swd(void);
+int cmd_swd_set_timing(unsigned speed, unsigned idle_cycles, void *DataBuffer);
+void cmd_swd_benchmark(void *DataBuffer);
+int cmd_swd_benchmark_dma(void *DataBuffer);
+int cmd_swd_set_wait_retry(unsigned max_retries, unsigned backoff);
+uint8_t cmd_swd_wait_retries(void);
+int cmd_swd_set_recovery(unsigned policies);
+int cmd_swd_read(uint8_t cmd_request, void *DataBuffer);
+int cmd_swd_write(uint8_t cmd_request, const void *DataBuffer);
+unsigned cmd_swd_batch(const uint8_t *ops, unsigned ops_length, unsigned flags, uint8_t *results, unsigned results_size, uint8_t *status);
+/* Memory block commands */
+#define CMD_MEM_BLOCK_MAX 0x8000
+#define CMD_MEM_PARAMS_SIZE 8
+#define CMD_MEM_TRAILER_SIZE 4
+#define CMD_MEM_PACKED 0x80
+
+int cmd_swd_mem_read_begin(const uint8_t *params, unsigned params_length, uint16_t *response_length);
+/*
+ The produce and consume_pma variants work in place on the USB packet memory:
+ 16-bit halfwords, each taking the low half of a 32-bit word.
+ */
+unsigned cmd_swd_mem_read_produce(volatile uint32_t *buffer, unsigned size);
+void cmd_swd_mem_write_begin(const uint8_t *params, unsigned payload_length);
+void cmd_swd_mem_write_consume(const uint8_t *data, unsigned length);
+void cmd_swd_mem_write_consume_pma(const volatile uint32_t *halfwords, unsigned length);
+unsigned cmd_swd_mem_write_end(uint8_t *results, uint8_t *status);
+/* STM32F1 flash programming */
+#define CMD_FLASH_PARAMS_SIZE 12
+#define CMD_FLASH_ERASE 0x80
+/* The smallest page size taken, for the per-page results */
+#define CMD_FLASH_PAGE_MIN 0x400
+
+void cmd_flash_program_begin(const uint8_t *params, unsigned payload_length);
+void cmd_flash_program_consume(const uint8_t *data, unsigned length);
+void cmd_flash_program_consume_pma(const volatile uint32_t *halfwords, unsigned length);
+unsigned cmd_flash_program_end(uint8_t *results, uint8_t *status);
+/* Memory polling */
+#define CMD_POLL_PARAMS_SIZE 20
+#define CMD_POLL_RESULTS_SIZE 8
+
+unsigned cmd_swd_poll_mem(const uint8_t *params, unsigned params_length, uint8_t *results, uint8_t *status);
+/* Memory sampling: timestamp (CPU cycles, 32 bits), value (32 bits) */
+#define CMD_SAMPLE_RECORD_SIZE 8
+
+int cmd_swd_sample_begin(const uint8_t *params, unsigned params_length);
+int cmd_swd_sample_due(void);
+int cmd_swd_sample(uint8_t *record);
+/* Halt watch event: status (8 bits), 3 zero bytes, DHCSR (32 bits) */
+#define CMD_WATCH_EVENT_SIZE 8
+
+int cmd_swd_watch_begin(const uint8_t *params, unsigned params_length);
+int cmd_swd_watch_due(void);
+int cmd_swd_watch(uint8_t *event);
+void cmd_gpio_configure(int enabled);
+void cmd_gpio_control(uint8_t bits);
+
+#endif /* __commands_h */
@@ -0,0 +1,600 @@
+#include <stdint.h>
+
+#include "swd.h"
+#include "dap.h"
+
+/* CMSIS-DAP v2 command processor, see dap.h */
+
+#define DAP_OK 0x00
+#define DAP_ERROR 0xFF
+
+/* DAP_Info IDs */
+#define DAP_ID_VENDOR 0x01
+#define DAP_ID_PRODUCT 0x02
+#define DAP_ID_PROTOCOL_VERSION 0x04
+#define DAP_ID_CAPABILITIES 0xF0
+#define DAP_ID_PACKET_COUNT 0xFE
+#define DAP_ID_PACKET_SIZE 0xFF
+
+#define DAP_CAPABILITY_SWD 0x01
+
+/* DAP_Connect ports */
+#define DAP_PORT_DEFAULT 0
+#define DAP_PORT_SWD 1
+
+/* Transfer request bits; the low 4 are the same as CMD_REQUEST_* */
+#define DAP_TRANSFER_APnDP 0x01
+#define DAP_TRANSFER_RnW 0x02
+#define DAP_TRANSFER_A32 0x0C
+#define DAP_TRANSFER_MATCH_VALUE 0x10
+#define DAP_TRANSFER_MATCH_MASK 0x20
+
+/* Transfer response: the last ACK, or one of the errors */
+#define DAP_TRANSFER_OK 0x01
+#define DAP_TRANSFER_WAIT 0x02
+#define DAP_TRANSFER_FAULT 0x04
+#define DAP_TRANSFER_ERROR 0x08
+#define DAP_TRANSFER_MISMATCH 0x10
+
+/* DP RDBUFF read: fetches the data of the last posted AP read, checks the last write */
+#define DAP_TRANSFER_RDBUFF (DAP_TRANSFER_RnW | DAP_TRANSFER_A32)
+/* DP ABORT write */
+#define DAP_TRANSFER_DP_ABORT 0x00
+
+volatile uint8_t dap_transfer_abort;
+
+static unsigned dap_speed = SWD_SPEED_DEFAULT;
+static unsigned dap_idle_cycles = SWD_IDLE_CYCLES_DEFAULT;
+static unsigned dap_wait_retry = 100;
+static unsigned dap_match_retry = 0;
+static uint32_t dap_match_mask;
+
+/* Request being parsed and response being built */
+typedef struct {
+    const uint8_t *in;
+    const uint8_t *in_end;
+    uint8_t *out;
+    uint8_t *out_end;
+    /* Set once the request ran short or the response did not fit */
+    int overrun;
+} dap_packet_t;
+
+static unsigned dap_available(const dap_packet_t *p)
+{
+    return p->in_end - p->in;
+}
+
+static int dap_room(dap_packet_t *p, unsigned size)
+{
+    if ((unsigned)(p->out_end - p->out) < size) {
+        p->overrun = 1;
+        return 0;
+    }
+    return 1;
+}
+
+/* Little endian fields; reading past the end of the request gives 0 */
+static uint32_t dap_get(dap_packet_t *p, unsigned size)
+{
+    uint32_t value = 0;
+    unsigned n;
+
+    if (dap_available(p) < size) {
+        p->overrun = 1;
+        p->in = p->in_end;
+        return 0;
+    }
+    for (n = 0; n < size; ++n) {
+        value |= (uint32_t)*p->in++ << (n * 8);
+    }
+    return value;
+}
+
+static void dap_put(dap_packet_t *p, uint32_t value, unsigned size)
+{
+    if (!dap_room(p, size))
+        return;
+    while (size--) {
+        *p->out++ = (uint8_t)value;
+        value >>= 8;
+    }
+}
+
+/* Start, APnDP, RnW, A[2:3], Parity, Stop, Park */
+static uint8_t dap_swd_request(uint8_t request)
+{
+    request &= DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | DAP_TRANSFER_A32;
+    return 0x81 | (request << 1) | (parity_even_4bit(request) << 5);
+}
+
+/*
+ One transaction, retried on WAIT as configured by DAP_TransferConfigure.
+ For reads, data may be 0 to drop the value. Returns the DAP_TRANSFER_* response.
+ */
+static uint8_t dap_swd_transfer(uint8_t request, uint32_t *data)
+{
+    const uint8_t swd_request = dap_swd_request(request);
+    unsigned retries = dap_wait_retry;
+    swd_response_t response;
+    uint32_t value = 0;
+    int parity_ok = 1;
+
+    for (;;) {
+        response = swd_request_response(swd_request);
+        if (request & DAP_TRANSFER_RnW) {
+            if (response == SWD_RESPONSE_OK)
+                parity_ok = swd_data_read(&value);
+            swd_turnaround(1);
+        } else {
+            swd_turnaround(1);
+            if (response == SWD_RESPONSE_OK)
+                swd_data_write(*data);
+        }
+        swd_idle_cycles();
+        if (response != SWD_RESPONSE_WAIT || !retries-- || dap_transfer_abort)
+            break;
+    }
+    if (response == SWD_RESPONSE_OK && (request & DAP_TRANSFER_RnW)) {
+        if (!parity_ok)
+            return DAP_TRANSFER_ERROR;
+        if (data)
+            *data = value;
+    }
+    return (uint8_t)response;
+}
+
+static void dap_info_string(dap_packet_t *p, const char *string)
+{
+    unsigned length = 0;
+
+    /* The length includes the terminator */
+    while (string[length++]);
+    dap_put(p, length, 1);
+    while (length--) {
+        dap_put(p, (uint8_t)*string++, 1);
+    }
+}
+
+static void dap_info(dap_packet_t *p)
+{
+    switch (dap_get(p, 1)) {
+    case DAP_ID_VENDOR:
+        dap_info_string(p, "dev_zzo");
+        break;
+    case DAP_ID_PRODUCT:
+        dap_info_string(p, "ARM ADIv5 Probe");
+        break;
+    case DAP_ID_PROTOCOL_VERSION:
+        dap_info_string(p, "2.1.0");
+        break;
+    case DAP_ID_CAPABILITIES:
+        dap_put(p, 1, 1);
+        dap_put(p, DAP_CAPABILITY_SWD, 1);
+        break;
+    case DAP_ID_PACKET_COUNT:
+        dap_put(p, 1, 1);
+        dap_put(p, DAP_PACKET_COUNT, 1);
+        break;
+    case DAP_ID_PACKET_SIZE:
+        dap_put(p, 2, 1);
+        dap_put(p, DAP_PACKET_SIZE, 2);
+        break;
+    default:
+        /* Not available; the serial number is the one of the USB device */
+        dap_put(p, 0, 1);
+        break;
+    }
+}
+
+static void dap_connect(dap_packet_t *p)
+{
+    unsigned port = dap_get(p, 1);
+
+    if (port == DAP_PORT_DEFAULT || port == DAP_PORT_SWD) {
+        swd_enable(1);
+        dap_put(p, DAP_PORT_SWD, 1);
+    } else {
+        /* No JTAG */
+        dap_put(p, 0, 1);
+    }
+}
+
+static void dap_transfer_configure(dap_packet_t *p)
+{
+    unsigned idle_cycles = dap_get(p, 1);
+    unsigned wait_retry = dap_get(p, 2);
+    unsigned match_retry = dap_get(p, 2);
+
+    if (p->overrun || !swd_set_timing(dap_speed, idle_cycles)) {
+        dap_put(p, DAP_ERROR, 1);
+        return;
+    }
+    dap_idle_cycles = idle_cycles;
+    dap_wait_retry = wait_retry;
+    dap_match_retry = match_retry;
+    dap_put(p, DAP_OK, 1);
+}
+
+/* Checks the transfers of a DAP_Transfer request are all there; returns their length, or -1 */
+static int dap_transfer_length(const uint8_t *in, unsigned available, unsigned count)
+{
+    unsigned length = 0;
+
+    while (count--) {
+        uint8_t request;
+
+        if (length >= available)
+            return -1;
+        request = in[length++];
+        /* Writes and value matches carry a value */
+        if (!(request & DAP_TRANSFER_RnW) || (request & DAP_TRANSFER_MATCH_VALUE))
+            length += 4;
+        if (length > available)
+            return -1;
+    }
+    return length;
+}
+
+/*
+ AP reads are posted: the data of one comes back with the next AP read, or with a RDBUFF read.
+ The last write is checked with a RDBUFF read, as its ACK may only be seen by the next transaction.
+ A read is only started once its data fits into the response along with that of a posted read;
+ otherwise the transfers stop there with DAP_TRANSFER_ERROR, the count telling what was done.
+ */
+static void dap_transfer(dap_packet_t *p)
+{
+    const uint8_t *end;
+    uint8_t *header;
+    unsigned count;
+    unsigned done = 0;
+    uint8_t response = 0;
+    int post_read = 0;
+    int check_write = 0;
+    int full = 0;
+    int length;
+
+    /* DAP index: there is a single one */
+    dap_get(p, 1);
+    count = dap_get(p, 1);
+    length = dap_transfer_length(p->in, dap_available(p), count);
+    if (!dap_room(p, 2))
+        return;
+    header = p->out;
+    p->out += 2;
+    if (p->overrun || length < 0) {
+        p->overrun = 1;
+        header[0] = 0;
+        header[1] = DAP_TRANSFER_ERROR;
+        return;
+    }
+    end = p->in + length;
+
+    for (; count && !dap_transfer_abort; --count) {
+        uint8_t request = dap_get(p, 1);
+        uint32_t data;
+
+        if ((request & (DAP_TRANSFER_RnW | DAP_TRANSFER_MATCH_VALUE)) == DAP_TRANSFER_RnW && !dap_room(p, post_read ? 8 : 4)) {
+            full = 1;
+            break;
+        }
+        if (request & DAP_TRANSFER_RnW) {
+            if (post_read) {
+                if ((request & (DAP_TRANSFER_APnDP | DAP_TRANSFER_MATCH_VALUE)) == DAP_TRANSFER_APnDP) {
+                    /* Posts this read at the same time */
+                    response = dap_swd_transfer(request, &data);
+                } else {
+                    response = dap_swd_transfer(DAP_TRANSFER_RDBUFF, &data);
+                    post_read = 0;
+                }
+                if (response != DAP_TRANSFER_OK)
+                    break;
+                dap_put(p, data, 4);
+            }
+            if (request & DAP_TRANSFER_MATCH_VALUE) {
+                const uint32_t match_value = dap_get(p, 4);
+                unsigned retries = dap_match_retry;
+
+                if (request & DAP_TRANSFER_APnDP) {
+                    response = dap_swd_transfer(request, 0);
+                    if (response != DAP_TRANSFER_OK)
+                        break;
+                }
+                do {
+                    response = dap_swd_transfer(request, &data);
+                } while (response == DAP_TRANSFER_OK && (data & dap_match_mask) != match_value && retries-- && !dap_transfer_abort);
+                if (response == DAP_TRANSFER_OK && (data & dap_match_mask) != match_value)
+                    response |= DAP_TRANSFER_MISMATCH;
+                if (response != DAP_TRANSFER_OK)
+                    break;
+            } else if (request & DAP_TRANSFER_APnDP) {
+                if (!post_read) {
+                    response = dap_swd_transfer(request, 0);
+                    if (response != DAP_TRANSFER_OK)
+                        break;
+                    post_read = 1;
+                }
+            } else {
+                response = dap_swd_transfer(request, &data);
+                if (response != DAP_TRANSFER_OK)
+                    break;
+                dap_put(p, data, 4);
+            }
+            check_write = 0;
+        } else {
+            if (post_read) {
+                response = dap_swd_transfer(DAP_TRANSFER_RDBUFF, &data);
+                if (response != DAP_TRANSFER_OK)
+                    break;
+                dap_put(p, data, 4);
+                post_read = 0;
+            }
+            data = dap_get(p, 4);
+            if (request & DAP_TRANSFER_MATCH_MASK) {
+                dap_match_mask = data;
+                response = DAP_TRANSFER_OK;
+            } else {
+                response = dap_swd_transfer(request, &data);
+                if (response != DAP_TRANSFER_OK)
+                    break;
+                check_write = 1;
+            }
+        }
+        done++;
+    }
+
+    if (response == DAP_TRANSFER_OK) {
+        if (post_read) {
+            uint32_t data;
+
+            response = dap_swd_transfer(DAP_TRANSFER_RDBUFF, &data);
+            if (response == DAP_TRANSFER_OK)
+                dap_put(p, data, 4);
+        } else if (check_write) {
+            response = dap_swd_transfer(DAP_TRANSFER_RDBUFF, 0);
+        }
+    }
+    if (full && (response == DAP_TRANSFER_OK || !response))
+        response = DAP_TRANSFER_ERROR;
+    /* Skips the transfers left undone */
+    p->in = end;
+    header[0] = (uint8_t)done;
+    header[1] = response;
+}
+
+static void dap_transfer_block(dap_packet_t *p)
+{
+    const uint8_t *end;
+    uint8_t *header;
+    unsigned count;
+    unsigned done = 0;
+    uint8_t request;
+    uint8_t response = 0;
+    uint32_t data;
+
+    /* DAP index: there is a single one */
+    dap_get(p, 1);
+    count = dap_get(p, 2);
+    request = dap_get(p, 1) & (DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | DAP_TRANSFER_A32);
+    if (!dap_room(p, 3))
+        return;
+    header = p->out;
+    p->out += 3;
+    if (p->overrun || (!(request & DAP_TRANSFER_RnW) && dap_available(p) < count * 4)) {
+        p->overrun = 1;
+        header[0] = 0;
+        header[1] = 0;
+        header[2] = DAP_TRANSFER_ERROR;
+        return;
+    }
+    end = (request & DAP_TRANSFER_RnW) ? p->in : p->in + count * 4;
+
+    if (count && (request & DAP_TRANSFER_RnW)) {
+        if (request & DAP_TRANSFER_APnDP) {
+            /* Post the first read */
+            response = dap_swd_transfer(request, 0);
+        } else {
+            response = DAP_TRANSFER_OK;
+        }
+        for (; response == DAP_TRANSFER_OK && count && !dap_transfer_abort; --count) {
+            /* The data of the last AP read comes from RDBUFF */
+            const int last_ap = (request & DAP_TRANSFER_APnDP) && count == 1;
+
+            if (!dap_room(p, 4)) {
+                /* The count tells what was done */
+                response = DAP_TRANSFER_ERROR;
+                break;
+            }
+            response = dap_swd_transfer(last_ap ? DAP_TRANSFER_RDBUFF : request, &data);
+            if (response != DAP_TRANSFER_OK)
+                break;
+            dap_put(p, data, 4);
+            done++;
+        }
+    } else if (count) {
+        for (; count && !dap_transfer_abort; --count) {
+            data = dap_get(p, 4);
+            response = dap_swd_transfer(request, &data);
+            if (response != DAP_TRANSFER_OK)
+                break;
+            done++;
+        }
+        if (response == DAP_TRANSFER_OK)
+            response = dap_swd_transfer(DAP_TRANSFER_RDBUFF, 0);
+    }
+    p->in = end;
+    header[0] = (uint8_t)done;
+    header[1] = (uint8_t)(done >> 8);
+    header[2] = response;
+}
+
+static void dap_write_abort(dap_packet_t *p)
+{
+    uint32_t data;
+
+    /* DAP index: there is a single one */
+    dap_get(p, 1);
+    data = dap_get(p, 4);
+    if (p->overrun || dap_swd_transfer(DAP_TRANSFER_DP_ABORT, &data) != DAP_TRANSFER_OK) {
+        dap_put(p, DAP_ERROR, 1);
+        return;
+    }
+    dap_put(p, DAP_OK, 1);
+}
+
+/* Picks the fastest speed not above the requested frequency */
+static void dap_swj_clock(dap_packet_t *p)
+{
+    uint32_t frequency = dap_get(p, 4);
+    unsigned speed;
+
+    if (p->overrun || !frequency) {
+        dap_put(p, DAP_ERROR, 1);
+        return;
+    }
+    for (speed = 0; speed < SWD_SPEED_COUNT - 1; ++speed) {
+        swd_set_timing(speed, dap_idle_cycles);
+        if (swd_measure_frequency() <= frequency)
+            break;
+    }
+    swd_set_timing(speed, dap_idle_cycles);
+    dap_speed = speed;
+    dap_put(p, DAP_OK, 1);
+}
+
+static void dap_swj_sequence(dap_packet_t *p)
+{
+    unsigned count = dap_get(p, 1);
+
+    if (!count)
+        count = 256;
+    if (p->overrun || dap_available(p) < (count + 7) / 8) {
+        p->overrun = 1;
+        dap_put(p, DAP_ERROR, 1);
+        return;
+    }
+    while (count) {
+        const unsigned bits = count > 8 ? 8 : count;
+
+        swd_bits_out(dap_get(p, 1), bits);
+        count -= bits;
+    }
+    dap_put(p, DAP_OK, 1);
+}
+
+/*
+ Runs one command; its ID is already in the response.
+ Returns 0 for unknown commands, whose length is not known either.
+ */
+static int dap_command(dap_packet_t *p, uint8_t command)
+{
+    switch (command) {
+    case DAP_CMD_INFO:
+        dap_info(p);
+        break;
+
+    case DAP_CMD_HOST_STATUS:
+        /* No status LEDs */
+        dap_get(p, 2);
+        dap_put(p, DAP_OK, 1);
+        break;
+
+    case DAP_CMD_CONNECT:
+        dap_connect(p);
+        break;
+
+    case DAP_CMD_DISCONNECT:
+        swd_enable(0);
+        dap_put(p, DAP_OK, 1);
+        break;
+
+    case DAP_CMD_TRANSFER_CONFIGURE:
+        dap_transfer_configure(p);
+        break;
+
+    case DAP_CMD_TRANSFER:
+        dap_transfer(p);
+        break;
+
+    case DAP_CMD_TRANSFER_BLOCK:
+        dap_transfer_block(p);
+        break;
+
+    case DAP_CMD_WRITE_ABORT:
+        dap_write_abort(p);
+        break;
+
+    case DAP_CMD_DELAY:
+        swd_delay_us(dap_get(p, 2));
+        dap_put(p, DAP_OK, 1);
+        break;
+
+    case DAP_CMD_RESET_TARGET:
+        /* No device specific reset sequence */
+        dap_put(p, DAP_OK, 1);
+        dap_put(p, 0, 1);
+        break;
+
+    case DAP_CMD_SWJ_PINS:
+        /* Output, select, wait; the pins are owned by the SWD layer and read back as 0 */
+        dap_get(p, 2);
+        dap_get(p, 4);
+        dap_put(p, 0, 1);
+        break;
+
+    case DAP_CMD_SWJ_CLOCK:
+        dap_swj_clock(p);
+        break;
+
+    case DAP_CMD_SWJ_SEQUENCE:
+        dap_swj_sequence(p);
+        break;
+
+    case DAP_CMD_SWD_CONFIGURE:
+        /* Only a 1 cycle turnaround without a data phase on WAIT/FAULT */
+        dap_put(p, dap_get(p, 1) == 0 ? DAP_OK : DAP_ERROR, 1);
+        break;
+
+    default:
+        return 0;
+    }
+    return 1;
+}
+
+static void dap_execute_commands(dap_packet_t *p)
+{
+    unsigned count = dap_get(p, 1);
+    unsigned done;
+
+    dap_put(p, count, 1);
+    for (done = 0; done < count && !p->overrun; ++done) {
+        uint8_t command = dap_get(p, 1);
+
+        dap_put(p, command, 1);
+        if (command == DAP_CMD_EXECUTE_COMMANDS || !dap_command(p, command))
+            break;
+    }
+}
+
+unsigned dap_execute(const uint8_t *request, unsigned request_length, uint8_t *response, unsigned response_size)
+{
+    dap_packet_t p;
+    uint8_t command;
+
+    /* Handled by the transport as it arrives */
+    if (!request_length || request[0] == DAP_CMD_TRANSFER_ABORT)
+        return 0;
+    p.in = request;
+    p.in_end = request + request_length;
+    p.out = response;
+    p.out_end = response + response_size;
+    p.overrun = 0;
+
+    command = dap_get(&p, 1);
+    dap_put(&p, command, 1);
+    if (command == DAP_CMD_EXECUTE_COMMANDS) {
+        dap_execute_commands(&p);
+    } else if (!dap_command(&p, command)) {
+        response[0] = DAP_CMD_INVALID;
+    }
+    return p.out - response;
+}
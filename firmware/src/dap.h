@@ -0,0 +1,44 @@
+#ifndef __dap_h
+#define __dap_h
+
+#include <stdint.h>
+
+/*
+ CMSIS-DAP v2 command processor, SWD only.
+ Works on whole request and response packets; the transport is up to the caller.
+ Only depends on the SWD protocol layer (swd.h), so it runs against a simulated one too.
+ */
+
+#define DAP_PACKET_SIZE 64
+/* Requests the transport can take while one is executing */
+#define DAP_PACKET_COUNT 4
+
+/* Command IDs */
+#define DAP_CMD_INFO 0x00
+#define DAP_CMD_HOST_STATUS 0x01
+#define DAP_CMD_CONNECT 0x02
+#define DAP_CMD_DISCONNECT 0x03
+#define DAP_CMD_TRANSFER_CONFIGURE 0x04
+#define DAP_CMD_TRANSFER 0x05
+#define DAP_CMD_TRANSFER_BLOCK 0x06
+#define DAP_CMD_TRANSFER_ABORT 0x07
+#define DAP_CMD_WRITE_ABORT 0x08
+#define DAP_CMD_DELAY 0x09
+#define DAP_CMD_RESET_TARGET 0x0A
+#define DAP_CMD_SWJ_PINS 0x10
+#define DAP_CMD_SWJ_CLOCK 0x11
+#define DAP_CMD_SWJ_SEQUENCE 0x12
+#define DAP_CMD_SWD_CONFIGURE 0x13
+#define DAP_CMD_EXECUTE_COMMANDS 0x7F
+#define DAP_CMD_INVALID 0xFF
+
+/*
+ Set by the transport when DAP_TransferAbort comes in while transfers are queued or running;
+ the transfer loops stop at the next transaction. Cleared by the transport once they are done.
+ */
+extern volatile uint8_t dap_transfer_abort;
+
+/* Returns the length of the response; 0 when the command has none */
+unsigned dap_execute(const uint8_t *request, unsigned request_length, uint8_t *response, unsigned response_size);
+
+#endif /* __dap_h */
@@ -19,4 +19,13 @@
 #define GPIO_CRH_PIN14 (GPIO_CRH_CNF14 | GPIO_CRH_MODE14)
 #define GPIO_CRH_PIN15 (GPIO_CRH_CNF15 | GPIO_CRH_MODE15)
 
+/* Bit-band alias of a bit in a peripheral register */
+#define BITBAND_PERIPH(reg, bit) \
+    (*(__IO uint32_t *)(PERIPH_BB_BASE + ((uint32_t)&(reg) - PERIPH_BASE) * 32 + (bit) * 4))
+
+/* DWT cycle counter; not defined by this CMSIS version */
+#define DWT_CTRL (*(__IO uint32_t *)0xE0001000U)
+#define DWT_CYCCNT (*(__IO uint32_t *)0xE0001004U)
+#define DWT_CTRL_CYCCNTENA (0x00000001U)
+
 #endif
@@ -11,6 +11,7 @@
 #include "hacks.h"
 #include "debug.h"
 #include "usb_core.h"
+#include "commands.h"
 
 /* Miscellaneous I/O */
 
@@ -37,7 +38,26 @@ static void setup(void)
 
 int main()
 {
+    uint8_t Record[CMD_SAMPLE_RECORD_SIZE];
+    uint8_t Event[CMD_WATCH_EVENT_SIZE];
+
     setup();
     for (;;) {
+        /* The USB interrupt only queues the work; everything touching the wire runs here */
+        USB_EP0Execute();
+        USB_EP1Execute();
+#if CMSIS_DAP
+        USB_EP3Execute();
+#endif
+        if (cmd_swd_sample_due() && cmd_swd_sample(Record)) {
+            NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+            USB_EP2StreamWrite(Record, sizeof(Record));
+            NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+        }
+        if (cmd_swd_watch_due() && cmd_swd_watch(Event)) {
+            NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+            USB_EP4EventWrite(Event, sizeof(Event));
+            NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+        }
     }
 }
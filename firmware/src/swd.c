@@ -3,27 +3,18 @@
 
 #include "hacks.h"
 #include "swd.h"
+#include "swd_phy.h"
 
 /* Serial Wire Debug Protocol physical layer implementation */
 
-typedef void (*swd_halfbit_delay_t)(void);
-
-static void swd_halfbit_delay(void)
-{
-    __asm__ __volatile__("\n\tnop;\n\tnop\n\tnop;\n\tnop;"::);
-    __asm__ __volatile__("\n\tnop;\n\tnop\n\tnop;\n\tnop;"::);
-    __asm__ __volatile__("\n\tnop;\n\tnop\n\tnop;\n\tnop;"::);
-    __asm__ __volatile__("\n\tnop;\n\tnop\n\tnop;\n\tnop;"::);
-    __asm__ __volatile__("\n\tnop;\n\tnop\n\tnop;\n\tnop;"::);
-    __asm__ __volatile__("\n\tnop;\n\tnop\n\tnop;\n\tnop;"::);
-    __asm__ __volatile__("\n\tnop;\n\tnop\n\tnop;\n\tnop;"::);
-    __asm__ __volatile__("\n\tnop;\n\tnop\n\tnop;\n\tnop;"::);
-}
-
-static swd_halfbit_delay_t swd_halfbit_delay_p = swd_halfbit_delay;
+uint32_t swd_crh_output;
+uint32_t swd_crh_input;
 
 void swd_enable(int enabled)
 {
+#if SWD_ENGINE == SWD_ENGINE_SPI
+    swd_spi_enable(enabled);
+#else
     const uint32_t pin_mask = ~(GPIO_CRH_PIN12 | GPIO_CRH_PIN13);
     /* Set up I/O Port B: SWD/JTAG pins */
     if (enabled) {
@@ -31,125 +22,281 @@ void swd_enable(int enabled)
         /* Pin 13: Max 10 MHz, gpio, push-pull: SWCLK */
         GPIOB->CRH = (GPIOB->CRH & pin_mask) | (GPIO_CRH_MODE12_0) | (GPIO_CRH_MODE13_0);
         GPIOB->ODR |= GPIO_ODR_ODR12 | GPIO_ODR_ODR13;
+        /* Pin 12 as input: pull-up/pull-down; ODR selects pull-up */
+        swd_crh_output = GPIOB->CRH;
+        swd_crh_input = (swd_crh_output & ~GPIO_CRH_PIN12) | (GPIO_CRH_CNF12_1);
     } else {
         /* Pin 12/13: input, floating */
         GPIOB->CRH = (GPIOB->CRH & pin_mask) | (GPIO_CRH_CNF12_0) | (GPIO_CRH_CNF13_0);
     }
+#endif
 }
 
-static void swd_swclk_L(void)
+static inline void swd_swclk_L(void)
 {
     GPIOB->BSRR = GPIO_BSRR_BR13;
 }
 
-static void swd_swclk_H(void)
+static inline void swd_swclk_H(void)
 {
     GPIOB->BSRR = GPIO_BSRR_BS13;
 }
 
-/* Rising: bit change; Falling: bit clock-in */
-static void swd_bit_out(int bit)
+#define SWD_NOP1 __asm__ __volatile__("\n\tnop;"::)
+#define SWD_NOP4 SWD_NOP1; SWD_NOP1; SWD_NOP1; SWD_NOP1
+#define SWD_NOP16 SWD_NOP4; SWD_NOP4; SWD_NOP4; SWD_NOP4
+
+/*
+ Straight NOPs, as the baseline delay had: the count is always a constant,
+ so the tests fold away and no loop overhead is added per half bit.
+ */
+static inline void swd_delay(unsigned count) __attribute__((always_inline));
+static inline void swd_delay(unsigned count)
 {
-    swd_swclk_H();
-    GPIOB->BSRR = bit ? GPIO_BSRR_BS12 : GPIO_BSRR_BR12;
-    swd_halfbit_delay_p();
-    swd_swclk_L();
-    swd_halfbit_delay_p();
+    if (count & 1) {
+        SWD_NOP1;
+    }
+    if (count & 2) {
+        SWD_NOP1; SWD_NOP1;
+    }
+    if (count & 4) {
+        SWD_NOP4;
+    }
+    if (count & 8) {
+        SWD_NOP4; SWD_NOP4;
+    }
+    if (count & 16) {
+        SWD_NOP16;
+    }
+    if (count & 32) {
+        SWD_NOP16; SWD_NOP16;
+    }
+    if (count & 64) {
+        SWD_NOP16; SWD_NOP16; SWD_NOP16; SWD_NOP16;
+    }
+    if (count & 128) {
+        SWD_NOP16; SWD_NOP16; SWD_NOP16; SWD_NOP16;
+        SWD_NOP16; SWD_NOP16; SWD_NOP16; SWD_NOP16;
+    }
 }
 
-#if 0
-/* Not used currently */
-/* Rising: bit clock-in; Falling: bit change */
-static void swd_bit_outN(int bit)
-{
-    swd_swclk_L();
-    GPIOB->BSRR = bit ? GPIO_BSRR_BS12 : GPIO_BSRR_BR12;
-    swd_halfbit_delay_p();
-    swd_swclk_H();
-    swd_halfbit_delay_p();
+/*
+ The bit loops are specialized for every supported half bit delay,
+ so the delay is a constant in the loop instead of a call per half bit.
+ Rising: bit change; Falling: bit clock-in
+ */
+#define SWD_DEFINE_PHY(delay) \
+static void swd_bits_out_##delay(uint32_t bits, int count) \
+{ \
+    while (count--) { \
+        swd_swclk_H(); \
+        GPIOB->BSRR = (bits & 1) ? SWD_SWDIO_BS : SWD_SWDIO_BR; \
+        swd_delay(delay); \
+        swd_swclk_L(); \
+        swd_delay(delay); \
+        bits >>= 1; \
+    } \
+} \
+static uint32_t swd_bits_in_##delay(int count) \
+{ \
+    uint32_t bits = 0; \
+    int count_in = count; \
+    while (count_in--) { \
+        swd_swclk_H(); \
+        swd_delay(delay); \
+        swd_swclk_L(); \
+        bits = (bits >> 1) | (((GPIOB->IDR >> SWD_SWDIO_IN_PIN) & 1) << 31); \
+        swd_delay(delay); \
+    } \
+    return bits >> (32 - count); \
+} \
+static void swd_turnaround_##delay(int writing) \
+{ \
+    swd_swclk_H(); \
+    GPIOB->BSRR = SWD_SWDIO_BS; \
+    if (!writing) { \
+        GPIOB->CRH = swd_crh_input; \
+    } \
+    swd_delay(delay); \
+    swd_swclk_L(); \
+    if (writing) { \
+        GPIOB->CRH = swd_crh_output; \
+    } \
+    swd_delay(delay); \
 }
+
+#define SWD_PHY(delay) \
+static const swd_phy_t swd_phy_##delay = { \
+    swd_bits_out_##delay, \
+    swd_bits_in_##delay, \
+    swd_turnaround_##delay, \
+    swd_loop_request_response, \
+    swd_loop_data_read, \
+    swd_loop_data_write, \
+};
+
+static swd_response_t swd_loop_request_response(uint8_t request);
+static int swd_loop_data_read(uint32_t *value);
+static void swd_loop_data_write(uint32_t value);
+
+SWD_DEFINE_PHY(0) SWD_PHY(0)
+SWD_DEFINE_PHY(1) SWD_PHY(1)
+SWD_DEFINE_PHY(2) SWD_PHY(2)
+SWD_DEFINE_PHY(4) SWD_PHY(4)
+SWD_DEFINE_PHY(8) SWD_PHY(8)
+SWD_DEFINE_PHY(16) SWD_PHY(16)
+SWD_DEFINE_PHY(32) SWD_PHY(32)
+SWD_DEFINE_PHY(64) SWD_PHY(64)
+SWD_DEFINE_PHY(128) SWD_PHY(128)
+
+const swd_phy_t * const swd_phy_loop = &swd_phy_0;
+
+/* Ordered from the fastest to the slowest */
+static const swd_phy_t * const swd_phys[SWD_SPEED_COUNT] = {
+#if SWD_ENGINE == SWD_ENGINE_BITBAND
+    &swd_phy_bitband,
+#elif SWD_ENGINE == SWD_ENGINE_SPI
+    &swd_phy_spi,
+#else
+    &swd_phy_0,
 #endif
+    &swd_phy_1,
+    &swd_phy_2,
+    &swd_phy_4,
+    &swd_phy_8,
+    &swd_phy_16,
+    &swd_phy_32,
+    &swd_phy_64,
+    &swd_phy_128,
+};
+
+/* Same as swd_phys[SWD_SPEED_DEFAULT] */
+static const swd_phy_t *swd_phy = &swd_phy_32;
+static int swd_idle_count = SWD_IDLE_CYCLES_DEFAULT;
 
-static uint32_t swd_bit_in(void)
+int swd_set_timing(unsigned speed, unsigned idle_cycles)
 {
-    uint32_t bit;
-    swd_swclk_H();
-    swd_halfbit_delay_p();
-    swd_swclk_L();
-    bit = (GPIOB->IDR & GPIO_IDR_IDR12) << (31 - 12);
-    swd_halfbit_delay_p();
-    return bit;
+    if (speed >= SWD_SPEED_COUNT || idle_cycles > SWD_IDLE_CYCLES_MAX)
+        return 0;
+    swd_phy = swd_phys[speed];
+    swd_idle_count = idle_cycles;
+    return 1;
 }
 
-void swd_turnaround(int writing)
+void swd_cycles_enable(void)
+{
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+}
+
+/* SystemCoreClock * bits / cycles without overflowing 32 bits */
+uint32_t swd_bit_rate(uint32_t bits, uint32_t cycles)
 {
-    swd_swclk_H();
-    GPIOB->BSRR = GPIO_BSRR_BS12;
-    if (!writing) {
-        /* Input */
-        GPIOB->CRH = (GPIOB->CRH & ~GPIO_CRH_PIN12) | (GPIO_CRH_CNF12_1);
+    return (SystemCoreClock / cycles) * bits + (SystemCoreClock % cycles) * bits / cycles;
+}
+
+/* Clocks idle cycles at the current speed and derives the SWCLK frequency in Hz */
+uint32_t swd_measure_frequency(void)
+{
+    const uint32_t bits = 256;
+    uint32_t cycles;
+    int counter;
+
+    swd_cycles_enable();
+    cycles = DWT_CYCCNT;
+    for (counter = 0; counter < bits / 32; ++counter) {
+        swd_phy->bits_out(0, 32);
     }
-    swd_halfbit_delay_p();
-    swd_swclk_L();
-    if (writing) {
-        /* Output */
-        GPIOB->CRH = (GPIOB->CRH & ~GPIO_CRH_PIN12) | (GPIO_CRH_MODE12_0);
+    cycles = DWT_CYCCNT - cycles;
+    return swd_bit_rate(bits, cycles);
+}
+
+/* Counts the CPU cycles taken by a complete DPIDR read transaction */
+static uint32_t swd_benchmark_read(void)
+{
+    uint32_t cycles;
+    uint32_t value;
+
+    cycles = DWT_CYCCNT;
+    /* Start, DP, Read, A=0, Parity=1, Stop, Park */
+    if (swd_request_response(0xA5) == SWD_RESPONSE_OK) {
+        swd_data_read(&value);
     }
-    swd_halfbit_delay_p();
+    swd_turnaround(1);
+    swd_idle_cycles();
+    return DWT_CYCCNT - cycles;
 }
 
-static void swd_bits_out(uint32_t bits, int count)
+/*
+ Runs the same transaction with the plain bit loops and with the engine used at the fastest speed.
+ The two counts are identical unless the firmware is built with another engine.
+ */
+void swd_benchmark_phy(uint32_t *loop_cycles, uint32_t *engine_cycles)
 {
-    while (count--) {
-        swd_bit_out(bits & 1);
-        bits >>= 1;
+    const swd_phy_t *saved_phy = swd_phy;
+
+    swd_cycles_enable();
+    swd_phy = swd_phy_loop;
+    *loop_cycles = swd_benchmark_read();
+    swd_phy = swd_phys[0];
+    *engine_cycles = swd_benchmark_read();
+    swd_phy = saved_phy;
+}
+
+void swd_turnaround(int writing)
+{
+    swd_phy->turnaround(writing);
+}
+
+void swd_idle_cycles(void)
+{
+    if (swd_idle_count) {
+        swd_phy->bits_out(0, swd_idle_count);
     }
 }
 
-#if 0
-/* Not used currently */
-static void swd_bits_outN(uint32_t bits, int count)
+void swd_idle_clocks(unsigned count)
 {
-    while (count--) {
-        swd_bit_outN(bits & 1);
-        bits >>= 1;
+    while (count > 32) {
+        swd_phy->bits_out(0, 32);
+        count -= 32;
+    }
+    if (count) {
+        swd_phy->bits_out(0, count);
     }
 }
-#endif
 
-static uint32_t swd_bits_in(int count)
+/* Clocks out up to 32 arbitrary bits, LSB first */
+void swd_bits_out(uint32_t bits, unsigned count)
 {
-    uint32_t bits = 0;
-    int count_in = count;
-    while (count_in--) {
-        bits = (bits >> 1) | swd_bit_in();
+    if (count) {
+        swd_phy->bits_out(bits, count);
     }
-    return bits >> (32 - count);
 }
 
-void swd_idle_cycles(void)
+void swd_delay_us(unsigned us)
 {
-    swd_bits_out(0, 8+1);
+    const uint32_t cycles = (SystemCoreClock / 1000000) * us;
+    uint32_t start;
+
+    swd_cycles_enable();
+    start = DWT_CYCCNT;
+    while (DWT_CYCCNT - start < cycles);
 }
 
-static void swd_line_reset(void)
+void swd_line_reset(void)
 {
-    int counter;
-    
-    for (counter = 0; counter < 50; ++counter) {
-        swd_swclk_H();
-        swd_halfbit_delay();
-        swd_swclk_L();
-        swd_halfbit_delay();
-    }
+    /* At least 50 clocks with SWDIO high */
+    swd_phy->bits_out(0xFFFFFFFFU, 32);
+    swd_phy->bits_out(0xFFFFFFFFU, 18);
 }
 
 void swj_switch_to_swd(void)
 {
     swd_line_reset();
-    swd_bits_out(0xE79EU, 16);
+    swd_phy->bits_out(0xE79EU, 16);
     swd_line_reset();
-    swd_idle_cycles();
+    swd_phy->bits_out(0, 8+1);
 }
 
 int parity_even_4bit(uint8_t bits)
@@ -168,29 +315,44 @@ static int parity_even_32bit(uint32_t bits)
     return parity;
 }
 
-swd_response_t swd_request_response(uint8_t request)
+static swd_response_t swd_loop_request_response(uint8_t request)
 {
-    swd_bits_out(request, 8);
-    swd_turnaround(0);
-    return (swd_response_t)swd_bits_in(3);
+    swd_phy->bits_out(request, 8);
+    swd_phy->turnaround(0);
+    return (swd_response_t)swd_phy->bits_in(3);
 }
 
-int swd_data_read(uint32_t *value)
+static int swd_loop_data_read(uint32_t *value)
 {
     uint32_t value_buffer = 0;
     int parity;
 
-    value_buffer = swd_bits_in(32);
+    value_buffer = swd_phy->bits_in(32);
     *value = value_buffer;
-    parity = swd_bit_in() >> 31;
+    parity = swd_phy->bits_in(1);
     return parity == parity_even_32bit(value_buffer);
 }
 
-void swd_data_write(uint32_t value)
+static void swd_loop_data_write(uint32_t value)
 {
     int parity;
 
     parity = parity_even_32bit(value);
-    swd_bits_out(value, 32);
-    swd_bit_out(parity);
+    swd_phy->bits_out(value, 32);
+    swd_phy->bits_out(parity, 1);
+}
+
+swd_response_t swd_request_response(uint8_t request)
+{
+    return swd_phy->request_response(request);
+}
+
+int swd_data_read(uint32_t *value)
+{
+    return swd_phy->data_read(value);
+}
+
+void swd_data_write(uint32_t value)
+{
+    swd_phy->data_write(value);
 }
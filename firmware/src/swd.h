@@ -8,13 +8,40 @@ typedef enum _swd_response_t {
     SWD_PROTOCOL_ERROR = 7,
 } swd_response_t;
 
+/* Index into the table of bit loops, from the fastest to the slowest */
+#define SWD_SPEED_COUNT 9
+#define SWD_SPEED_DEFAULT 6
+
+#define SWD_IDLE_CYCLES_DEFAULT 9
+#define SWD_IDLE_CYCLES_MAX 32
+
+/* Timer + DMA paced write streams, see swd_dma.c */
+#ifndef SWD_DMA
+#define SWD_DMA 0
+#endif
+
 void swd_enable(int enabled);
+int swd_set_timing(unsigned speed, unsigned idle_cycles);
+uint32_t swd_measure_frequency(void);
+void swd_benchmark_phy(uint32_t *loop_cycles, uint32_t *engine_cycles);
+void swd_line_reset(void);
 void swj_switch_to_swd(void);
 void swd_turnaround(int writing);
 void swd_idle_cycles(void);
+void swd_idle_clocks(unsigned count);
+void swd_bits_out(uint32_t bits, unsigned count);
+void swd_delay_us(unsigned us);
 swd_response_t swd_request_response(uint8_t request);
 int swd_data_read(uint32_t *value);
 void swd_data_write(uint32_t value);
 int parity_even_4bit(uint8_t bits);
 
+#if SWD_DMA
+void swd_dma_set_frequency(uint32_t frequency);
+void swd_dma_begin(void);
+int swd_dma_write(uint8_t request, uint32_t value);
+unsigned swd_dma_end(swd_response_t *response);
+uint32_t swd_dma_benchmark(void);
+#endif
+
 #endif /* __swd_h */
@@ -0,0 +1,139 @@
+#include <stm32f10x.h>
+#include <stdint.h>
+
+#include "hacks.h"
+#include "swd.h"
+#include "swd_phy.h"
+
+/*
+ Serial Wire Debug Protocol physical layer: unrolled bit-band engine
+
+ SWDIO/SWCLK are driven through the bit-band aliases of GPIOB->ODR,
+ so a single store sets a line and only bit 0 of the value matters.
+ The request and data phases are fully unrolled and run without delays.
+ */
+
+#if SWD_ENGINE == SWD_ENGINE_BITBAND
+
+#define SWD_BB_SWDIO BITBAND_PERIPH(GPIOB->ODR, 12)
+#define SWD_BB_SWCLK BITBAND_PERIPH(GPIOB->ODR, 13)
+#define SWD_BB_SWDIO_IN BITBAND_PERIPH(GPIOB->IDR, 12)
+
+/* Rising: bit change; Falling: bit clock-in */
+#define SWD_BB_BIT_OUT(value, n) \
+    do { \
+        SWD_BB_SWCLK = 1; \
+        SWD_BB_SWDIO = (value) >> (n); \
+        SWD_BB_SWCLK = 0; \
+    } while (0)
+
+#define SWD_BB_BIT_IN(value, n) \
+    do { \
+        SWD_BB_SWCLK = 1; \
+        SWD_BB_SWCLK = 0; \
+        (value) |= SWD_BB_SWDIO_IN << (n); \
+    } while (0)
+
+#define SWD_BB_BYTE_OUT(value, n) \
+    do { \
+        SWD_BB_BIT_OUT(value, (n) + 0); \
+        SWD_BB_BIT_OUT(value, (n) + 1); \
+        SWD_BB_BIT_OUT(value, (n) + 2); \
+        SWD_BB_BIT_OUT(value, (n) + 3); \
+        SWD_BB_BIT_OUT(value, (n) + 4); \
+        SWD_BB_BIT_OUT(value, (n) + 5); \
+        SWD_BB_BIT_OUT(value, (n) + 6); \
+        SWD_BB_BIT_OUT(value, (n) + 7); \
+    } while (0)
+
+#define SWD_BB_BYTE_IN(value, n) \
+    do { \
+        SWD_BB_BIT_IN(value, (n) + 0); \
+        SWD_BB_BIT_IN(value, (n) + 1); \
+        SWD_BB_BIT_IN(value, (n) + 2); \
+        SWD_BB_BIT_IN(value, (n) + 3); \
+        SWD_BB_BIT_IN(value, (n) + 4); \
+        SWD_BB_BIT_IN(value, (n) + 5); \
+        SWD_BB_BIT_IN(value, (n) + 6); \
+        SWD_BB_BIT_IN(value, (n) + 7); \
+    } while (0)
+
+static void swd_bb_bits_out(uint32_t bits, int count)
+{
+    while (count--) {
+        SWD_BB_BIT_OUT(bits, 0);
+        bits >>= 1;
+    }
+}
+
+static uint32_t swd_bb_bits_in(int count)
+{
+    uint32_t bits = 0;
+    int n;
+    for (n = 0; n < count; ++n) {
+        SWD_BB_BIT_IN(bits, n);
+    }
+    return bits;
+}
+
+static void swd_bb_turnaround(int writing)
+{
+    SWD_BB_SWCLK = 1;
+    SWD_BB_SWDIO = 1;
+    if (!writing) {
+        GPIOB->CRH = swd_crh_input;
+    }
+    SWD_BB_SWCLK = 0;
+    if (writing) {
+        GPIOB->CRH = swd_crh_output;
+    }
+}
+
+static swd_response_t swd_bb_request_response(uint8_t request)
+{
+    uint32_t response = 0;
+    uint32_t bits = request;
+
+    SWD_BB_BYTE_OUT(bits, 0);
+    swd_bb_turnaround(0);
+    SWD_BB_BIT_IN(response, 0);
+    SWD_BB_BIT_IN(response, 1);
+    SWD_BB_BIT_IN(response, 2);
+    return (swd_response_t)response;
+}
+
+static int swd_bb_data_read(uint32_t *value)
+{
+    uint32_t value_buffer = 0;
+    uint32_t parity = 0;
+
+    SWD_BB_BYTE_IN(value_buffer, 0);
+    SWD_BB_BYTE_IN(value_buffer, 8);
+    SWD_BB_BYTE_IN(value_buffer, 16);
+    SWD_BB_BYTE_IN(value_buffer, 24);
+    SWD_BB_BIT_IN(parity, 0);
+    *value = value_buffer;
+    return parity == parity_even_32bit_fold(value_buffer);
+}
+
+static void swd_bb_data_write(uint32_t value)
+{
+    uint32_t parity = parity_even_32bit_fold(value);
+
+    SWD_BB_BYTE_OUT(value, 0);
+    SWD_BB_BYTE_OUT(value, 8);
+    SWD_BB_BYTE_OUT(value, 16);
+    SWD_BB_BYTE_OUT(value, 24);
+    SWD_BB_BIT_OUT(parity, 0);
+}
+
+const swd_phy_t swd_phy_bitband = {
+    swd_bb_bits_out,
+    swd_bb_bits_in,
+    swd_bb_turnaround,
+    swd_bb_request_response,
+    swd_bb_data_read,
+    swd_bb_data_write,
+};
+
+#endif
@@ -0,0 +1,259 @@
+#include <stm32f10x.h>
+#include <stdint.h>
+
+#include "hacks.h"
+#include "swd.h"
+#include "swd_phy.h"
+
+/*
+ Serial Wire Debug Protocol physical layer: timer paced DMA write streams
+
+ Runs of write transactions are prebuilt as waveforms and clocked out by hardware.
+ TIM1 generates SWCLK on PB13 (TIM1_CH1N, PWM) and, on every bit:
+ - the update (rising edge) DMAs the next SWDIO value into GPIOB->BSRR;
+ - CC2, just after the rising edge, DMAs the SWDIO direction into GPIOB->CRH;
+ - CC3, just after the falling edge, DMAs GPIOB->IDR into the capture buffer.
+ The CPU encodes the next buffer while the current one clocks out,
+ and checks the captured ACKs once a buffer is done.
+
+ The data phase is clocked whatever the ACK is. This is only valid with
+ overrun detection enabled (DP CTRL/STAT.ORUNDETECT): a failed write then
+ makes the following ones fail too, until the sticky flags are cleared.
+ */
+
+#if SWD_DMA
+
+#if SWD_ENGINE == SWD_ENGINE_SPI
+#error "The DMA write engine needs PB13 for TIM1 while the SPI engine hands it to SPI2"
+#endif
+
+/*
+ The bit period follows the speed set with swd_set_timing(), as measured on the bit loops.
+ It is 36 ticks (72 MHz / 36 = 2 MHz) at the shortest: every bit takes three DMA transfers.
+ */
+#define SWD_DMA_BIT_TICKS_MIN 36
+#define SWD_DMA_BIT_TICKS_MAX 0x10000
+
+/* Request 8, turnaround 1, ACK 3, turnaround 1, data 32, parity 1, idle 2 */
+#define SWD_DMA_TRANSACTION_BITS 48
+#define SWD_DMA_TURNAROUND_BIT 8
+#define SWD_DMA_ACK_BIT 9
+#define SWD_DMA_DATA_BIT 13
+
+#define SWD_DMA_TRANSACTIONS 4
+#define SWD_DMA_BUFFER_BITS (SWD_DMA_TRANSACTIONS * SWD_DMA_TRANSACTION_BITS)
+
+typedef struct {
+    uint32_t bsrr[SWD_DMA_BUFFER_BITS];
+    uint16_t capture[SWD_DMA_BUFFER_BITS];
+    unsigned count;
+} swd_dma_buffer_t;
+
+/* The direction is the same for every transaction, so the buffers share it */
+static uint32_t swd_dma_crh[SWD_DMA_BUFFER_BITS];
+static swd_dma_buffer_t swd_dma_buffers[2];
+static swd_dma_buffer_t *swd_dma_filling;
+static swd_dma_buffer_t *swd_dma_running;
+
+/* Timer ticks per bit; 0 until the speed is known */
+static uint32_t swd_dma_bit_ticks;
+
+/* Writes acknowledged with OK before the first failure, and that failure */
+static unsigned swd_dma_acked;
+static swd_response_t swd_dma_response;
+
+static void swd_dma_setup(void)
+{
+    /* Pin 13: Max 10 MHz, alt out, push-pull: SWCLK from TIM1 */
+    const uint32_t crh_output = (swd_crh_output & ~GPIO_CRH_PIN13) | (GPIO_CRH_MODE13_0 | GPIO_CRH_CNF13_1);
+    const uint32_t crh_input = (swd_crh_input & ~GPIO_CRH_PIN13) | (GPIO_CRH_MODE13_0 | GPIO_CRH_CNF13_1);
+    unsigned bit;
+
+    for (bit = 0; bit < SWD_DMA_BUFFER_BITS; ++bit) {
+        unsigned phase = bit % SWD_DMA_TRANSACTION_BITS;
+        swd_dma_crh[bit] = (phase >= SWD_DMA_TURNAROUND_BIT && phase < SWD_DMA_DATA_BIT) ? crh_input : crh_output;
+    }
+
+    RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+    RCC->APB2ENR |= RCC_APB2ENR_TIM1EN;
+    TIM1->CR1 = 0;
+    TIM1->PSC = 0;
+    TIM1->ARR = swd_dma_bit_ticks - 1;
+    /* PWM mode 1: CH1N follows OC1REF, high from the update to CCR1 */
+    TIM1->CCMR1 = TIM_CCMR1_OC1M_2 | TIM_CCMR1_OC1M_1;
+    TIM1->CCR1 = swd_dma_bit_ticks / 2;
+    TIM1->CCR2 = 1;
+    TIM1->CCR3 = swd_dma_bit_ticks / 2 + 1;
+    TIM1->CCER = TIM_CCER_CC1NE;
+    TIM1->BDTR = TIM_BDTR_MOE;
+    /* TIM1_UP: channel 5; TIM1_CH2: channel 3; TIM1_CH3: channel 6 */
+    DMA1_Channel5->CPAR = (uint32_t)&GPIOB->BSRR;
+    DMA1_Channel3->CPAR = (uint32_t)&GPIOB->CRH;
+    DMA1_Channel6->CPAR = (uint32_t)&GPIOB->IDR;
+}
+
+static void swd_dma_start(swd_dma_buffer_t *buffer)
+{
+    const uint32_t bits = buffer->count * SWD_DMA_TRANSACTION_BITS;
+
+    DMA1->IFCR = DMA_IFCR_CGIF3 | DMA_IFCR_CGIF5 | DMA_IFCR_CGIF6;
+    DMA1_Channel5->CMAR = (uint32_t)&buffer->bsrr[0];
+    DMA1_Channel5->CNDTR = bits;
+    DMA1_Channel5->CCR = DMA_CCR5_DIR | DMA_CCR5_MINC | DMA_CCR5_PSIZE_1 | DMA_CCR5_MSIZE_1 | DMA_CCR5_PL_1 | DMA_CCR5_EN;
+    DMA1_Channel3->CMAR = (uint32_t)&swd_dma_crh[0];
+    DMA1_Channel3->CNDTR = bits;
+    DMA1_Channel3->CCR = DMA_CCR3_DIR | DMA_CCR3_MINC | DMA_CCR3_PSIZE_1 | DMA_CCR3_MSIZE_1 | DMA_CCR3_PL_1 | DMA_CCR3_EN;
+    DMA1_Channel6->CMAR = (uint32_t)&buffer->capture[0];
+    DMA1_Channel6->CNDTR = bits;
+    DMA1_Channel6->CCR = DMA_CCR6_MINC | DMA_CCR6_PSIZE_0 | DMA_CCR6_MSIZE_0 | DMA_CCR6_PL_1 | DMA_CCR6_EN;
+
+    TIM1->CNT = 0;
+    TIM1->SR = 0;
+    TIM1->DIER = TIM_DIER_UDE | TIM_DIER_CC2DE | TIM_DIER_CC3DE;
+    /* Hand SWCLK to the timer: this is the rising edge of the first bit */
+    GPIOB->CRH = swd_dma_crh[0];
+    /* The first bit goes out on a forced update; the rest on the timer updates */
+    TIM1->EGR = TIM_EGR_UG;
+    TIM1->CR1 = TIM_CR1_CEN;
+    swd_dma_running = buffer;
+}
+
+static uint32_t swd_dma_captured(const uint16_t *capture, int n)
+{
+    return (capture[n] >> SWD_SWDIO_IN_PIN) & 1;
+}
+
+/* Waits for the running buffer, if any, and checks its ACKs */
+static void swd_dma_finish(void)
+{
+    swd_dma_buffer_t *buffer = swd_dma_running;
+    unsigned n;
+
+    if (!buffer)
+        return;
+    /* The capture is the last transfer of every bit */
+    while (!(DMA1->ISR & DMA_ISR_TCIF6));
+    TIM1->CR1 = 0;
+    TIM1->DIER = 0;
+    DMA1_Channel3->CCR = 0;
+    DMA1_Channel5->CCR = 0;
+    DMA1_Channel6->CCR = 0;
+    /* Hand SWCLK back to GPIO, low */
+    GPIOB->CRH = swd_crh_output;
+    swd_dma_running = 0;
+
+    for (n = 0; n < buffer->count && swd_dma_response == SWD_RESPONSE_OK; ++n) {
+        const uint16_t *capture = &buffer->capture[n * SWD_DMA_TRANSACTION_BITS + SWD_DMA_ACK_BIT];
+        swd_response_t response;
+
+        response = (swd_response_t)(swd_dma_captured(capture, 0) | (swd_dma_captured(capture, 1) << 1) | (swd_dma_captured(capture, 2) << 2));
+        if (response == SWD_RESPONSE_OK) {
+            swd_dma_acked++;
+        } else {
+            swd_dma_response = response;
+        }
+    }
+    buffer->count = 0;
+}
+
+static void swd_dma_encode(swd_dma_buffer_t *buffer, uint8_t request, uint32_t value)
+{
+    uint32_t *bsrr = &buffer->bsrr[buffer->count * SWD_DMA_TRANSACTION_BITS];
+    uint32_t bits;
+    int n;
+
+    for (n = 0, bits = request; n < 8; ++n, bits >>= 1) {
+        *bsrr++ = (bits & 1) ? SWD_SWDIO_BS : SWD_SWDIO_BR;
+    }
+    /* Turnaround, ACK, turnaround: released, ODR selects pull-up */
+    for (n = SWD_DMA_TURNAROUND_BIT; n < SWD_DMA_DATA_BIT; ++n) {
+        *bsrr++ = SWD_SWDIO_BS;
+    }
+    for (n = 0, bits = value; n < 32; ++n, bits >>= 1) {
+        *bsrr++ = (bits & 1) ? SWD_SWDIO_BS : SWD_SWDIO_BR;
+    }
+    *bsrr++ = parity_even_32bit_fold(value) ? SWD_SWDIO_BS : SWD_SWDIO_BR;
+    *bsrr++ = SWD_SWDIO_BR;
+    *bsrr++ = SWD_SWDIO_BR;
+    buffer->count++;
+}
+
+/* Sets the SWCLK frequency in Hz, rounded down to what the timer gives and capped at 2 MHz */
+void swd_dma_set_frequency(uint32_t frequency)
+{
+    uint32_t ticks = (SystemCoreClock + frequency - 1) / frequency;
+
+    if (ticks < SWD_DMA_BIT_TICKS_MIN)
+        ticks = SWD_DMA_BIT_TICKS_MIN;
+    if (ticks > SWD_DMA_BIT_TICKS_MAX)
+        ticks = SWD_DMA_BIT_TICKS_MAX;
+    swd_dma_bit_ticks = ticks;
+}
+
+void swd_dma_begin(void)
+{
+    if (!swd_dma_bit_ticks) {
+        /* Nothing set yet: the default speed; the measurement only clocks idle cycles */
+        swd_dma_set_frequency(swd_measure_frequency());
+    }
+    swd_dma_setup();
+    swd_dma_buffers[0].count = 0;
+    swd_dma_buffers[1].count = 0;
+    swd_dma_filling = &swd_dma_buffers[0];
+    swd_dma_running = 0;
+    swd_dma_acked = 0;
+    swd_dma_response = SWD_RESPONSE_OK;
+}
+
+/*
+ Queues a write transaction; a full buffer is started as soon as the previous one is done.
+ Returns 0 once a failed write has been seen, so the caller may stop queueing.
+ */
+int swd_dma_write(uint8_t request, uint32_t value)
+{
+    swd_dma_encode(swd_dma_filling, request, value);
+    if (swd_dma_filling->count == SWD_DMA_TRANSACTIONS) {
+        swd_dma_finish();
+        swd_dma_start(swd_dma_filling);
+        swd_dma_filling = swd_dma_filling == &swd_dma_buffers[0] ? &swd_dma_buffers[1] : &swd_dma_buffers[0];
+    }
+    return swd_dma_response == SWD_RESPONSE_OK;
+}
+
+/*
+ Clocks out what is still queued and waits for it.
+ Returns the amount of writes acknowledged with OK before the first failure;
+ *response is the ACK of that failure, or SWD_RESPONSE_OK.
+ */
+unsigned swd_dma_end(swd_response_t *response)
+{
+    swd_dma_finish();
+    if (swd_dma_filling->count) {
+        swd_dma_start(swd_dma_filling);
+        swd_dma_finish();
+    }
+    *response = swd_dma_response;
+    return swd_dma_acked;
+}
+
+/* Streams DP ABORT writes of 0, which change nothing, and derives the sustained bits per second */
+uint32_t swd_dma_benchmark(void)
+{
+    const uint32_t transactions = 64;
+    swd_response_t response;
+    uint32_t cycles;
+    unsigned n;
+
+    swd_cycles_enable();
+    cycles = DWT_CYCCNT;
+    swd_dma_begin();
+    for (n = 0; n < transactions; ++n) {
+        /* Start, DP, Write, A=0, Parity=0, Stop, Park */
+        swd_dma_write(0x81, 0);
+    }
+    swd_dma_end(&response);
+    cycles = DWT_CYCCNT - cycles;
+    return swd_bit_rate(transactions * SWD_DMA_TRANSACTION_BITS, cycles);
+}
+
+#endif
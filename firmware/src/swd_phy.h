@@ -0,0 +1,66 @@
+#ifndef __swd_phy_h
+#define __swd_phy_h
+
+/* Interface between the SWD protocol code and the PHY engines */
+
+/* Engines selectable for the fastest speed at build time */
+#define SWD_ENGINE_GPIO 0
+#define SWD_ENGINE_BITBAND 1
+#define SWD_ENGINE_SPI 2
+
+#ifndef SWD_ENGINE
+#define SWD_ENGINE SWD_ENGINE_GPIO
+#endif
+
+/*
+ SWCLK is always PB13. SWDIO is PB12, except for the SPI engine:
+ there SWDIO has to be wired to PB15 (SPI2 MOSI, driving) and PB14 (SPI2 MISO, sampling).
+ */
+#if SWD_ENGINE == SWD_ENGINE_SPI
+#define SWD_SWDIO_OUT_PIN 15
+#define SWD_SWDIO_IN_PIN 14
+#else
+#define SWD_SWDIO_OUT_PIN 12
+#define SWD_SWDIO_IN_PIN 12
+#endif
+
+#define SWD_SWDIO_BS (1U << SWD_SWDIO_OUT_PIN)
+#define SWD_SWDIO_BR (1U << (SWD_SWDIO_OUT_PIN + 16))
+
+typedef struct {
+    void (*bits_out)(uint32_t bits, int count);
+    uint32_t (*bits_in)(int count);
+    void (*turnaround)(int writing);
+    swd_response_t (*request_response)(uint8_t request);
+    int (*data_read)(uint32_t *value);
+    void (*data_write)(uint32_t value);
+} swd_phy_t;
+
+/* GPIOB->CRH values with SWDIO as output and input; set up by swd_enable() */
+extern uint32_t swd_crh_output;
+extern uint32_t swd_crh_input;
+
+/* DWT cycle counter based measurements */
+void swd_cycles_enable(void);
+uint32_t swd_bit_rate(uint32_t bits, uint32_t cycles);
+
+/* The plain bit loops without delays; also used by the engines for odd bits */
+extern const swd_phy_t * const swd_phy_loop;
+
+#if SWD_ENGINE == SWD_ENGINE_BITBAND
+extern const swd_phy_t swd_phy_bitband;
+#endif
+#if SWD_ENGINE == SWD_ENGINE_SPI
+extern const swd_phy_t swd_phy_spi;
+void swd_spi_enable(int enabled);
+#endif
+
+static inline uint32_t parity_even_32bit_fold(uint32_t bits)
+{
+    bits ^= bits >> 16;
+    bits ^= bits >> 8;
+    bits ^= bits >> 4;
+    return (0x6996U >> (bits & 0xF)) & 1;
+}
+
+#endif /* __swd_phy_h */
@@ -0,0 +1,139 @@
+#include <stm32f10x.h>
+#include <stdint.h>
+
+#include "hacks.h"
+#include "swd.h"
+#include "swd_phy.h"
+
+/*
+ Serial Wire Debug Protocol physical layer: SPI2 accelerated engine
+
+ The byte-aligned phases (8-bit request, 32-bit data) are shifted by SPI2,
+ LSB first, mode 1: the bit changes on the rising edge and is clocked in
+ on the falling one, same as the bit loops. The turnaround, ACK and parity
+ bits are bit-banged on the same pins with the plain bit loops.
+
+ Wiring: SWCLK on PB13 (SPI2 SCK); SWDIO on PB15 (SPI2 MOSI) and PB14 (SPI2 MISO).
+ For reads, PB15 is switched to input so only the target drives SWDIO.
+ */
+
+#if SWD_ENGINE == SWD_ENGINE_SPI
+
+/* SPI2 runs from APB1 (36 MHz); /4 gives 9 MHz */
+#define SWD_SPI_BAUDRATE (SPI_CR1_BR_0)
+
+/* GPIOB->CRH values with SCK/MOSI handed to SPI2 */
+static uint32_t swd_crh_spi_output;
+static uint32_t swd_crh_spi_input;
+
+void swd_spi_enable(int enabled)
+{
+    const uint32_t pin_mask = ~(GPIO_CRH_PIN12 | GPIO_CRH_PIN13 | GPIO_CRH_PIN14 | GPIO_CRH_PIN15);
+    uint32_t crh = GPIOB->CRH & pin_mask;
+
+    if (enabled) {
+        /* Pin 12: input, floating: not used */
+        /* Pin 13: Max 10 MHz, gpio, push-pull: SWCLK */
+        /* Pin 14: input, pull-up: SWDIO in */
+        /* Pin 15: Max 10 MHz, gpio, push-pull: SWDIO out */
+        GPIOB->ODR |= GPIO_ODR_ODR13 | GPIO_ODR_ODR14 | GPIO_ODR_ODR15;
+        swd_crh_output = crh | (GPIO_CRH_CNF12_0) | (GPIO_CRH_MODE13_0) | (GPIO_CRH_CNF14_1) | (GPIO_CRH_MODE15_0);
+        swd_crh_input = crh | (GPIO_CRH_CNF12_0) | (GPIO_CRH_MODE13_0) | (GPIO_CRH_CNF14_1) | (GPIO_CRH_CNF15_1);
+        /* Pin 13/15: Max 50 MHz, alt out, push-pull */
+        swd_crh_spi_output = crh | (GPIO_CRH_CNF12_0) | (GPIO_CRH_MODE13 | GPIO_CRH_CNF13_1) | (GPIO_CRH_CNF14_1) | (GPIO_CRH_MODE15 | GPIO_CRH_CNF15_1);
+        swd_crh_spi_input = crh | (GPIO_CRH_CNF12_0) | (GPIO_CRH_MODE13 | GPIO_CRH_CNF13_1) | (GPIO_CRH_CNF14_1) | (GPIO_CRH_CNF15_1);
+        GPIOB->CRH = swd_crh_output;
+        /* Set up SPI2: master, software NSS, LSB first, mode 1 */
+        RCC->APB1ENR |= RCC_APB1ENR_SPI2EN;
+        RCC->APB1RSTR &= ~RCC_APB1RSTR_SPI2RST;
+        SPI2->CR2 = 0;
+        SPI2->CR1 = SPI_CR1_MSTR | SPI_CR1_SSM | SPI_CR1_SSI | SPI_CR1_LSBFIRST | SPI_CR1_CPHA | SWD_SPI_BAUDRATE;
+        SPI2->CR1 |= SPI_CR1_SPE;
+    } else {
+        SPI2->CR1 = 0;
+        RCC->APB1ENR &= ~RCC_APB1ENR_SPI2EN;
+        /* Pin 12-15: input, floating */
+        GPIOB->CRH = crh | (GPIO_CRH_CNF12_0) | (GPIO_CRH_CNF13_0) | (GPIO_CRH_CNF14_0) | (GPIO_CRH_CNF15_0);
+    }
+}
+
+static uint32_t swd_spi_transfer(uint32_t value)
+{
+    SPI2->DR = value;
+    while (!(SPI2->SR & SPI_SR_RXNE));
+    return SPI2->DR;
+}
+
+/* Hands SCK/MOSI back to GPIO, keeping the last bit on SWDIO */
+static void swd_spi_release(uint32_t last_bit)
+{
+    while (SPI2->SR & SPI_SR_BSY);
+    GPIOB->BSRR = last_bit ? SWD_SWDIO_BS : SWD_SWDIO_BR;
+}
+
+static void swd_spi_bits_out(uint32_t bits, int count)
+{
+    swd_phy_loop->bits_out(bits, count);
+}
+
+static uint32_t swd_spi_bits_in(int count)
+{
+    return swd_phy_loop->bits_in(count);
+}
+
+static void swd_spi_turnaround(int writing)
+{
+    swd_phy_loop->turnaround(writing);
+}
+
+static swd_response_t swd_spi_request_response(uint8_t request)
+{
+    GPIOB->CRH = swd_crh_spi_output;
+    swd_spi_transfer(request);
+    swd_spi_release(request >> 7);
+    GPIOB->CRH = swd_crh_output;
+    swd_phy_loop->turnaround(0);
+    return (swd_response_t)swd_phy_loop->bits_in(3);
+}
+
+static int swd_spi_data_read(uint32_t *value)
+{
+    uint32_t value_buffer;
+    uint32_t parity;
+
+    GPIOB->CRH = swd_crh_spi_input;
+    value_buffer = swd_spi_transfer(0xFF);
+    value_buffer |= swd_spi_transfer(0xFF) << 8;
+    value_buffer |= swd_spi_transfer(0xFF) << 16;
+    value_buffer |= swd_spi_transfer(0xFF) << 24;
+    swd_spi_release(1);
+    GPIOB->CRH = swd_crh_input;
+    parity = swd_phy_loop->bits_in(1);
+    *value = value_buffer;
+    return parity == parity_even_32bit_fold(value_buffer);
+}
+
+static void swd_spi_data_write(uint32_t value)
+{
+    uint32_t parity = parity_even_32bit_fold(value);
+
+    GPIOB->CRH = swd_crh_spi_output;
+    swd_spi_transfer(value & 0xFF);
+    swd_spi_transfer((value >> 8) & 0xFF);
+    swd_spi_transfer((value >> 16) & 0xFF);
+    swd_spi_transfer(value >> 24);
+    swd_spi_release(value >> 31);
+    GPIOB->CRH = swd_crh_output;
+    swd_phy_loop->bits_out(parity, 1);
+}
+
+const swd_phy_t swd_phy_spi = {
+    swd_spi_bits_out,
+    swd_spi_bits_in,
+    swd_spi_turnaround,
+    swd_spi_request_response,
+    swd_spi_data_read,
+    swd_spi_data_write,
+};
+
+#endif
@@ -59,9 +59,9 @@ void USB_ConfigureRxBuffer(unsigned EPIndex, unsigned BufferIndex, uint16_t Addr
     uint16_t Blocks;
     Descr->ADDR_RX = Address;
     if (Size > 62) {
-        /* Use 32-byte blocks */
+        /* Use 32-byte blocks; NUM_BLOCK counts them from 0 */
         Descr->BLOCK_SIZE = 1;
-        Blocks = (Size + 31) >> 5;
+        Blocks = ((Size + 31) >> 5) - 1;
     } else {
         /* Use 2-byte blocks */
         Descr->BLOCK_SIZE = 0;
@@ -70,6 +70,80 @@ void USB_ConfigureRxBuffer(unsigned EPIndex, unsigned BufferIndex, uint16_t Addr
     Descr->NUM_BLOCK = Blocks;
 }
 
+/* Buffers are allocated bottom-up past the buffer table and released in the reverse order */
+static uint16_t USB_PMATop = USB_EP_BUFFERS_START;
+
+uint16_t USB_PMAMark(void)
+{
+    return USB_PMATop;
+}
+
+void USB_PMARelease(uint16_t Mark)
+{
+    USB_PMATop = Mark;
+}
+
+uint16_t USB_PMAAlloc(uint16_t Size)
+{
+    uint16_t Address = USB_PMATop;
+    /* Buffers are accessed in halfwords */
+    Size = (Size + 1) & ~1;
+    if (Size > USB_PMA_SIZE - USB_PMATop) {
+        return 0;
+    }
+    USB_PMATop += Size;
+    return Address;
+}
+
+/* RX buffers are sized in blocks, so they may take more than requested */
+static uint16_t USB_RxBufferSize(uint16_t Size)
+{
+    return Size > 62 ? (Size + 31) & ~31 : (Size + 1) & ~1;
+}
+
+BOOL USB_ConfigureEndpoint(unsigned EPIndex, uint16_t Type, uint16_t TxSize, uint16_t RxSize)
+{
+    uint16_t Address;
+    if (TxSize) {
+        Address = USB_PMAAlloc(TxSize);
+        if (!Address) {
+            return FALSE;
+        }
+        USB_ConfigureTxBuffer(EPIndex, USB_EP_BUFFER_TX, Address);
+    }
+    if (RxSize) {
+        Address = USB_PMAAlloc(USB_RxBufferSize(RxSize));
+        if (!Address) {
+            return FALSE;
+        }
+        USB_ConfigureRxBuffer(EPIndex, USB_EP_BUFFER_RX, Address, RxSize);
+    }
+    /* Both directions NAK until the application arms them */
+    USB_SetEPxR(EPIndex, Type | EPIndex);
+    if (TxSize) {
+        USB_SetEPTxStatus(EPIndex, USB_EPxR_STAT_TX_NAK);
+    }
+    if (RxSize) {
+        USB_SetEPRxStatus(EPIndex, USB_EPxR_STAT_RX_NAK);
+    }
+    return TRUE;
+}
+
+BOOL USB_ConfigureDoubleBufferedIn(unsigned EPIndex, uint16_t Size)
+{
+    uint16_t Address0 = USB_PMAAlloc(Size);
+    uint16_t Address1 = USB_PMAAlloc(Size);
+    if (!Address0 || !Address1) {
+        return FALSE;
+    }
+    USB_ConfigureTxBuffer(EPIndex, 0, Address0);
+    USB_ConfigureTxBuffer(EPIndex, 1, Address1);
+    /* EP_KIND selects double-buffering; DTOG_TX and SW_BUF both start at 0 */
+    USB_SetEPxR(EPIndex, USB_EPxR_EP_BULK | USB_EPxR_EP_KIND | EPIndex);
+    USB_SetEPTxStatus(EPIndex, USB_EPxR_STAT_TX_VALID);
+    return TRUE;
+}
+
 static void USB_UserToPMAMemcpy(const void *UserBuffer, uint16_t PMAAddress, uint16_t Count)
 {
     const uint16_t *UserBufferPtr = (const uint16_t *)UserBuffer;
@@ -80,6 +80,9 @@ typedef struct
 #define USB_EPxR_STAT_TX_NAK      (USB_EPxR_STAT_TX_1)
 #define USB_EPxR_STAT_TX_VALID    (USB_EPxR_STAT_TX_0|USB_EPxR_STAT_TX_1)
 
+/* For double-buffered IN endpoints, DTOG_RX selects the buffer owned by the application */
+#define USB_EPxR_SW_BUF           (USB_EPxR_DTOG_RX)
+
 #define USB_EPxR_STAT_RX_DIS      (0)
 #define USB_EPxR_STAT_RX_STALL    (USB_EPxR_STAT_RX_0)
 #define USB_EPxR_STAT_RX_NAK      (USB_EPxR_STAT_RX_1)
@@ -130,6 +133,18 @@ typedef struct
         USB_SetEPxR((EpNum), RegVal | USB_EPxR_CTR_RX | USB_EPxR_CTR_TX); \
     }
 
+/*
+ Double-buffered IN endpoints: the hardware sends the buffer selected by DTOG_TX,
+ the application fills the one selected by SW_BUF, and toggling SW_BUF hands it over.
+ While both select the same buffer the hardware has nothing to send and NAKs.
+ */
+#define USB_GetEPTxAppBuffer(EpNum) \
+    ((USB_GetEPxR(EpNum) & USB_EPxR_SW_BUF) ? 1 : 0)
+#define USB_IsEPTxHardwareWaiting(EpNum) \
+    (!(USB_GetEPxR(EpNum) & USB_EPxR_DTOG_TX) == !(USB_GetEPxR(EpNum) & USB_EPxR_SW_BUF))
+#define USB_ReleaseEPTxAppBuffer(EpNum) \
+    USB_ToggleEPRxDTOG(EpNum)
+
 #define USB_SetEPAddress(EpNum, Address) \
     USB_SetEPxR((EpNum), (USB_GetEPxRNonToggled(EpNum) & (~USB_EPxR_EA)) | USB_EPxR_CTR_RX | USB_EPxR_CTR_TX | (Address))
 
@@ -162,10 +177,30 @@ typedef struct {
 #define USB_EP_BUFFER_TX 0
 #define USB_EP_BUFFER_RX 1
 
+/* Size of the PMA, in bytes as seen by the peripheral */
+#define USB_PMA_SIZE 512
+/* Endpoint buffers start right past the buffer table entries of the endpoints in use */
+#define USB_EP_BUFFERS_START (USB_BTABLE + USB_EP_USED * 8)
+
 #define USB_GetTxDescriptor(EPIndex, BufIndex) \
-    (&((USB_TxDescriptor *)PMA_BASE)[(EPIndex) * 2 + (BufferIndex)])
+    (&((USB_TxDescriptor *)PMA_BASE)[(EPIndex) * 2 + (BufIndex)])
 #define USB_GetRxDescriptor(EPIndex, BufIndex) \
-    (&((USB_RxDescriptor *)PMA_BASE)[(EPIndex) * 2 + (BufferIndex)])
+    (&((USB_RxDescriptor *)PMA_BASE)[(EPIndex) * 2 + (BufIndex)])
+
+/* The PMA as seen by the CPU: every 16-bit halfword takes the low half of a 32-bit word */
+typedef volatile uint32_t USB_PMAWord;
+#define USB_PMAPointer(PMAAddress) \
+    ((USB_PMAWord *)(PMA_BASE + (PMAAddress) * 2))
+
+/* In place access to the endpoint buffers, skipping the copies to and from RAM */
+#define USB_GetTxBuffer(EPIndex, BufIndex) \
+    USB_PMAPointer(USB_GetTxDescriptor(EPIndex, BufIndex)->ADDR_TX)
+#define USB_GetRxBuffer(EPIndex, BufIndex) \
+    USB_PMAPointer(USB_GetRxDescriptor(EPIndex, BufIndex)->ADDR_RX)
+#define USB_SetTxCount(EPIndex, BufIndex, Count) \
+    (USB_GetTxDescriptor(EPIndex, BufIndex)->COUNT_TX = (Count))
+#define USB_GetRxCount(EPIndex, BufIndex) \
+    (USB_GetRxDescriptor(EPIndex, BufIndex)->COUNT_RX)
 
 /*********************** External USB core API  *******************************/
 
@@ -187,6 +222,26 @@ void USB_Enable(void);
  */
 void USB_ConfigureTxBuffer(unsigned EPIndex, unsigned BufferIndex, uint16_t Address);
 void USB_ConfigureRxBuffer(unsigned EPIndex, unsigned BufferIndex, uint16_t Address, uint16_t Size);
+
+/*
+ The PMA allocator hands out endpoint buffers past the buffer table.
+ USB_PMAAlloc returns 0 once the PMA is exhausted.
+ Everything allocated after a mark is freed at once by releasing it.
+ */
+uint16_t USB_PMAAlloc(uint16_t Size);
+uint16_t USB_PMAMark(void);
+void USB_PMARelease(uint16_t Mark);
+
+/*
+ Allocates the buffers for the endpoint and sets it up with both directions NAKing;
+ a zero size leaves that direction disabled. Type is one of USB_EPxR_EP_*.
+ */
+BOOL USB_ConfigureEndpoint(unsigned EPIndex, uint16_t Type, uint16_t TxSize, uint16_t RxSize);
+/*
+ Sets up a double-buffered bulk IN endpoint: both buffer descriptors hold TX buffers.
+ The endpoint is VALID; it NAKs until the application releases its first buffer.
+ */
+BOOL USB_ConfigureDoubleBufferedIn(unsigned EPIndex, uint16_t Size);
 void USB_UserToEndpointMemcpy(unsigned EPIndex, unsigned BufferIndex, const void *UserBuffer, uint16_t DataSize);
 uint16_t USB_EndpointToUserMemcpy(unsigned EPIndex, unsigned BufferIndex, void *UserBuffer, uint16_t BufferSize);
 
@@ -199,8 +254,46 @@ void USB_EP0Configure(void);
 void USB_EP0Handler(USB_EventType Event);
 /* Other endpoint handlers are declared with the similar function name */
 
+/*
+ This function should configure the bulk endpoint 1.
+ To be implemented by the application; called on SET_CONFIGURATION.
+ */
+void USB_EP1Configure(void);
+
+/*
+ This function should configure the streaming endpoint 2.
+ To be implemented by the application; called on SET_CONFIGURATION.
+ */
+void USB_EP2Configure(void);
+
+/*
+ This function should configure the CMSIS-DAP bulk endpoint 3.
+ To be implemented by the application; called on SET_CONFIGURATION.
+ */
+void USB_EP3Configure(void);
+
+/*
+ This function should configure the event endpoint 4.
+ To be implemented by the application; called on SET_CONFIGURATION.
+ */
+void USB_EP4Configure(void);
+/*
+ These functions run the requests and commands deferred by the USB interrupt.
+ To be implemented by the application; called from the main loop.
+ */
+void USB_EP0Execute(void);
+void USB_EP1Execute(void);
+void USB_EP3Execute(void);
+
+/* Queues a record on the stream; to be called with the USB interrupt masked */
+BOOL USB_EP2StreamWrite(const void *Record, unsigned Length);
+/* Queues an event; to be called with the USB interrupt masked */
+BOOL USB_EP4EventWrite(const void *Event, unsigned Length);
+void USB_EP4EventFlush(void);
+
 extern USB_SetupPacketDef USB_SetupPacket;
 extern uint8_t USB_DeviceConfiguration;
+extern volatile uint8_t USB_EP0SetupCount;
 
 void USB_EP0SetupDataOut(void *Buffer, uint16_t AvailableCount, uint16_t RequestedCount);
 void USB_EP0SetupDataIn(const void *Buffer, uint16_t AvailableCount, uint16_t RequestedCount);
@@ -209,12 +302,35 @@ void USB_EP0ArmForStatusIn(void);
 BOOL USB_EP0OutTransferCompletionStdHandler(void);
 void USB_EP0StatusCompletionStdHandler(void);
 void USB_EP0ArmForSetup(void);
+void USB_EP0Stall(void);
+/*
+ Called from the OUT transfer completion handler: the endpoint keeps NAKing the status stage
+ until the application arms it (or stalls it) from the main loop.
+ A request left pending by the SETUP handler returning TRUE without arming NAKs the same way.
+ */
+void USB_EP0DeferStatus(void);
 
 /*********************** Configuration parameters *****************************/
 
 /* Bitmask of interrupts handled during normal ops; from USB_CNTR_* */
 #define USB_HANDLED_INTS (0)
 
-#define USB_EP0_SIZE 8
+/* CMSIS-DAP v2 interface on endpoint 3 (1/0) */
+#ifndef CMSIS_DAP
+#define CMSIS_DAP 0
+#endif
+
+#define USB_EP0_SIZE 64
+#define USB_EP1_SIZE 64
+#if CMSIS_DAP
+/* Leaves room in the PMA for endpoint 3 */
+#define USB_EP2_SIZE 32
+#else
+#define USB_EP2_SIZE 64
+#endif
+#define USB_EP3_SIZE 64
+#define USB_EP4_SIZE 8
+/* Endpoints 0 to 4; the buffer table entries of the others are never used */
+#define USB_EP_USED 5
 
 #endif /* __stm32_usbcore_h */
@@ -1,5 +1,6 @@
 #include "usb_core.h"
 #include "debug.h"
+#include "commands.h"
 
 /******************************************************************************/
 /* Control endpoint 0 handling code -- application specific                   */
@@ -12,12 +13,21 @@ void led_activity(int state);
 const struct {
     USB_CONFIGURATION_DESCRIPTOR Config;
     USB_INTERFACE_DESCRIPTOR Interface0;
+    USB_ENDPOINT_DESCRIPTOR Endpoint1Out;
+    USB_ENDPOINT_DESCRIPTOR Endpoint1In;
+    USB_ENDPOINT_DESCRIPTOR Endpoint2In;
+    USB_ENDPOINT_DESCRIPTOR Endpoint4In;
+#if CMSIS_DAP
+    USB_INTERFACE_DESCRIPTOR Interface1;
+    USB_ENDPOINT_DESCRIPTOR Endpoint3Out;
+    USB_ENDPOINT_DESCRIPTOR Endpoint3In;
+#endif
 } __attribute__((packed)) USB_Config1Descriptor = {
     {
         sizeof(USB_CONFIGURATION_DESCRIPTOR), /* Length */
         USB_CONFIGURATION_DESCRIPTOR_TYPE, /* DescriptorType */
         sizeof(USB_Config1Descriptor), /* TotalLength */
-        1, /* NumInterfaces */
+        1 + CMSIS_DAP, /* NumInterfaces */
         1, /* ConfigurationValue */
         4, /* iConfiguration */
         USB_CONFIG_BUS_POWERED, /* Attributes */
@@ -28,12 +38,74 @@ const struct {
         USB_INTERFACE_DESCRIPTOR_TYPE, /* DescriptorType */
         0, /* InterfaceNumber */
         0, /* AlternateSetting */
-        0, /* NumEndpoints */
+        4, /* NumEndpoints */
         USB_DEVICE_CLASS_VENDOR_SPECIFIC, /* InterfaceClass */
         0x00, /* InterfaceSubClass */
         0x00, /* InterfaceProtocol */
         5, /* iInterface */
     },
+    {
+        sizeof(USB_ENDPOINT_DESCRIPTOR), /* Length */
+        USB_ENDPOINT_DESCRIPTOR_TYPE, /* DescriptorType */
+        USB_ENDPOINT_OUT(1), /* EndpointAddress */
+        USB_ENDPOINT_TYPE_BULK, /* Attributes */
+        USB_EP1_SIZE, /* MaxPacketSize */
+        0, /* Interval */
+    },
+    {
+        sizeof(USB_ENDPOINT_DESCRIPTOR), /* Length */
+        USB_ENDPOINT_DESCRIPTOR_TYPE, /* DescriptorType */
+        USB_ENDPOINT_IN(1), /* EndpointAddress */
+        USB_ENDPOINT_TYPE_BULK, /* Attributes */
+        USB_EP1_SIZE, /* MaxPacketSize */
+        0, /* Interval */
+    },
+    {
+        sizeof(USB_ENDPOINT_DESCRIPTOR), /* Length */
+        USB_ENDPOINT_DESCRIPTOR_TYPE, /* DescriptorType */
+        USB_ENDPOINT_IN(2), /* EndpointAddress */
+        USB_ENDPOINT_TYPE_BULK, /* Attributes */
+        USB_EP2_SIZE, /* MaxPacketSize */
+        0, /* Interval */
+    },
+    {
+        sizeof(USB_ENDPOINT_DESCRIPTOR), /* Length */
+        USB_ENDPOINT_DESCRIPTOR_TYPE, /* DescriptorType */
+        USB_ENDPOINT_IN(4), /* EndpointAddress */
+        USB_ENDPOINT_TYPE_INTERRUPT, /* Attributes */
+        USB_EP4_SIZE, /* MaxPacketSize */
+        1, /* Interval */
+    },
+#if CMSIS_DAP
+    /* CMSIS-DAP v2: found by the interface string; the OUT endpoint comes first */
+    {
+        sizeof(USB_INTERFACE_DESCRIPTOR), /* Length */
+        USB_INTERFACE_DESCRIPTOR_TYPE, /* DescriptorType */
+        1, /* InterfaceNumber */
+        0, /* AlternateSetting */
+        2, /* NumEndpoints */
+        USB_DEVICE_CLASS_VENDOR_SPECIFIC, /* InterfaceClass */
+        0x00, /* InterfaceSubClass */
+        0x00, /* InterfaceProtocol */
+        6, /* iInterface */
+    },
+    {
+        sizeof(USB_ENDPOINT_DESCRIPTOR), /* Length */
+        USB_ENDPOINT_DESCRIPTOR_TYPE, /* DescriptorType */
+        USB_ENDPOINT_OUT(3), /* EndpointAddress */
+        USB_ENDPOINT_TYPE_BULK, /* Attributes */
+        USB_EP3_SIZE, /* MaxPacketSize */
+        0, /* Interval */
+    },
+    {
+        sizeof(USB_ENDPOINT_DESCRIPTOR), /* Length */
+        USB_ENDPOINT_DESCRIPTOR_TYPE, /* DescriptorType */
+        USB_ENDPOINT_IN(3), /* EndpointAddress */
+        USB_ENDPOINT_TYPE_BULK, /* Attributes */
+        USB_EP3_SIZE, /* MaxPacketSize */
+        0, /* Interval */
+    },
+#endif
 };
 
 const USB_CONFIGURATION_DESCRIPTOR * const USB_ConfigDescriptors[] = {
@@ -70,6 +142,11 @@ const USB_STRING_DESCRIPTOR USB_StringIface0Descriptor = {
     USB_STRING_DESCRIPTOR_TYPE,
     { 'I', 'n', 't', 'e', 'r', 'f', 'a', 'c', 'e', ' ', '0', },
 };
+const USB_STRING_DESCRIPTOR USB_StringIface1Descriptor = {
+    sizeof(USB_STRING_DESCRIPTOR) + 2 * 12,
+    USB_STRING_DESCRIPTOR_TYPE,
+    { 'C', 'M', 'S', 'I', 'S', '-', 'D', 'A', 'P', ' ', 'v', '2', },
+};
 const USB_STRING_DESCRIPTOR * const USB_StringDescriptors[] = {
     &USB_String0Descriptor,
     &USB_StringMfgDescriptor,
@@ -77,6 +154,7 @@ const USB_STRING_DESCRIPTOR * const USB_StringDescriptors[] = {
     (USB_STRING_DESCRIPTOR *)&USB_StringSerialDescriptor,
     &USB_StringConfig1Descriptor,
     &USB_StringIface0Descriptor,
+    &USB_StringIface1Descriptor,
 };
 
 const USB_DEVICE_DESCRIPTOR USB_DeviceDescriptor = {
@@ -159,10 +237,8 @@ void USB_Deconfigure(void)
     }
 }
 
-#define USB_EP_BUFFERS_START (0x40)
-
-#define USB_EP0_TX_BUFFER_AT (USB_EP_BUFFERS_START)
-#define USB_EP0_RX_BUFFER_AT (USB_EP0_TX_BUFFER_AT + USB_EP0_SIZE)
+/* PMA taken by endpoint 0; everything past it belongs to the configuration */
+static uint16_t USB_ConfigBuffersMark;
 
 BOOL USB_SetConfiguration(unsigned Configuration)
 {
@@ -174,7 +250,29 @@ BOOL USB_SetConfiguration(unsigned Configuration)
         break;
     case 1:
         USB_Deconfigure();
-        /* Nothing here for now */
+        USB_PMARelease(USB_ConfigBuffersMark);
+        /* Configure endpoint 1: bulk IN and OUT */
+        if (!USB_ConfigureEndpoint(1, USB_EPxR_EP_BULK, USB_EP1_SIZE, USB_EP1_SIZE)) {
+            return FALSE;
+        }
+        USB_EP1Configure();
+        /* Configure endpoint 2: double-buffered bulk IN stream */
+        if (!USB_ConfigureDoubleBufferedIn(2, USB_EP2_SIZE)) {
+            return FALSE;
+        }
+        USB_EP2Configure();
+        /* Configure endpoint 4: interrupt IN events */
+        if (!USB_ConfigureEndpoint(4, USB_EPxR_EP_INTERRUPT, USB_EP4_SIZE, 0)) {
+            return FALSE;
+        }
+        USB_EP4Configure();
+#if CMSIS_DAP
+        /* Configure endpoint 3: CMSIS-DAP bulk OUT and IN */
+        if (!USB_ConfigureEndpoint(3, USB_EPxR_EP_BULK, USB_EP3_SIZE, USB_EP3_SIZE)) {
+            return FALSE;
+        }
+        USB_EP3Configure();
+#endif
         break;
     default:
         /* Failed */
@@ -186,21 +284,14 @@ BOOL USB_SetConfiguration(unsigned Configuration)
 
 void USB_EP0Configure(void)
 {
-    /* Configure buffers for endpoint 0 */
-    USB_ConfigureTxBuffer(0, USB_EP_BUFFER_TX, USB_EP0_TX_BUFFER_AT);
-    USB_ConfigureRxBuffer(0, USB_EP_BUFFER_RX, USB_EP0_RX_BUFFER_AT, USB_EP0_SIZE);
-    /* Configure endpoint 0 */
-    USB_SetEPxR(0, USB_EPxR_EP_CONTROL);
+    /* Every buffer is gone after a reset */
+    USB_PMARelease(USB_EP_BUFFERS_START);
+    /* Configure endpoint 0 and its buffers */
+    USB_ConfigureEndpoint(0, USB_EPxR_EP_CONTROL, USB_EP0_SIZE, USB_EP0_SIZE);
+    USB_ConfigBuffersMark = USB_PMAMark();
     USB_EP0ArmForSetup();
 }
 
-void cmd_swd_enable(int enabled);
-void cmd_switch_to_swd(void);
-int cmd_swd_read(uint8_t cmd_request, void *DataBuffer);
-int cmd_swd_write(uint8_t cmd_request, const void *DataBuffer);
-void cmd_gpio_configure(int enabled);
-void cmd_gpio_control(uint8_t bits);
-
 #define APP_REQUEST_PING 0
 #define APP_REQUEST_CONFIGURE_SWJ 1
 #define APP_REQUEST_SWITCH_TO_SWD 2
@@ -209,12 +300,71 @@ void cmd_gpio_control(uint8_t bits);
 #define APP_REQUEST_GPIO_CONFIGURE 5
 #define APP_REQUEST_GPIO_CONTROL 6
 #define APP_REQUEST_GET_STATUS 7
-
-static uint8_t DataBuffer[4];
+#define APP_REQUEST_SET_SWD_TIMING 8
+#define APP_REQUEST_BENCHMARK_SWD 9
+#define APP_REQUEST_SET_WAIT_RETRY 10
+#define APP_REQUEST_SET_RECOVERY 11
+/*
+ Vectors: the data stage holds up to a packet of ops, encoded as for the bulk batch command,
+ wValue holds the batch flags; the status stage completes once the ops are done.
+ The results are then fetched with APP_REQUEST_VECTOR_RESULTS: the status of the vector,
+ followed by the per-op results as for the bulk batch command.
+ */
+#define APP_REQUEST_VECTOR 12
+#define APP_REQUEST_VECTOR_RESULTS 13
+#define APP_VECTOR_SIZE USB_EP0_SIZE
+/*
+ Transfers: the SWD request bits (CMD_REQUEST_*) are or'ed into the request code,
+ wValue/wIndex hold the low/high halves of the data to write.
+ The data stage returns the status (CMD_STATUS_*), the WAIT retry count, 2 zero bytes
+ and the data read; the request never stalls on a failed transaction.
+ */
+#define APP_REQUEST_TRANSFER 0x80
+#define APP_REQUEST_TRANSFER_MASK 0xF0
+#define APP_TRANSFER_RESPONSE_SIZE 8
+
+/* Value of APP_REQUEST_BENCHMARK_SWD */
+#define APP_BENCHMARK_PHY 0
+#define APP_BENCHMARK_DMA 1
+
+static uint8_t DataBuffer[8] __attribute__((aligned(4)));
 static int OpResult;
+static uint8_t StatusBuffer[2];
+static uint8_t VectorOps[APP_VECTOR_SIZE];
+static uint16_t VectorOpsLength;
+static uint8_t VectorResults[APP_VECTOR_SIZE];
+static uint16_t VectorResultsLength;
+
+/*
+ Requests which clock the wire run from the main loop, so they never hold up the interrupt;
+ the endpoint NAKs until they are done. The request is taken from the SETUP packet it came with,
+ saved here: another SETUP may overwrite the packet before the main loop gets to it.
+ */
+static volatile BOOL APP_EP0Pending;
+static uint8_t APP_EP0PendingSetup;
+static uint8_t APP_EP0PendingRequest;
+static uint16_t APP_EP0PendingValue;
+static uint16_t APP_EP0PendingIndex;
+static uint16_t APP_EP0PendingLength;
+static BOOL APP_EP0PendingDataIn;
+
+static BOOL USB_EP0DeferRequest(void)
+{
+    APP_EP0PendingSetup = USB_EP0SetupCount;
+    APP_EP0PendingRequest = USB_SetupPacket.Request;
+    APP_EP0PendingValue = USB_SetupPacket.Value.Raw;
+    APP_EP0PendingIndex = USB_SetupPacket.Index.Raw;
+    APP_EP0PendingLength = USB_SetupPacket.Length;
+    APP_EP0PendingDataIn = USB_SetupPacket.RequestType.Dir == USB_REQUEST_DEVICE_TO_HOST;
+    APP_EP0Pending = TRUE;
+    return TRUE;
+}
 
 BOOL USB_EP0SetupVendorRequestHandler(void)
 {
+    if ((USB_SetupPacket.Request & APP_REQUEST_TRANSFER_MASK) == APP_REQUEST_TRANSFER) {
+        return USB_EP0DeferRequest();
+    }
     switch (USB_SetupPacket.Request) {
 
     case APP_REQUEST_PING:
@@ -222,25 +372,29 @@ BOOL USB_EP0SetupVendorRequestHandler(void)
         return TRUE;
 
     case APP_REQUEST_CONFIGURE_SWJ:
-        cmd_swd_enable(!!USB_SetupPacket.Value.Raw);
-        USB_EP0ArmForStatusIn();
-        return TRUE;
-
     case APP_REQUEST_SWITCH_TO_SWD:
-        cmd_switch_to_swd();
-        USB_EP0ArmForStatusIn();
+    case APP_REQUEST_READ:
+    case APP_REQUEST_SET_SWD_TIMING:
+    case APP_REQUEST_BENCHMARK_SWD:
+        return USB_EP0DeferRequest();
+
+    case APP_REQUEST_WRITE:
+        /* Deferred once the data is in */
+        USB_EP0SetupDataOut(&DataBuffer[0], 4, USB_SetupPacket.Length);
         return TRUE;
 
-    case APP_REQUEST_READ:
-        OpResult = cmd_swd_read(USB_SetupPacket.Value.Raw & 0xFF, &DataBuffer[0]);
-        if (OpResult) {
+    case APP_REQUEST_VECTOR:
+        if (USB_SetupPacket.RequestType.Dir != USB_REQUEST_HOST_TO_DEVICE
+            || USB_SetupPacket.Length == 0 || USB_SetupPacket.Length > APP_VECTOR_SIZE) {
             return FALSE;
         }
-        USB_EP0SetupDataIn(&DataBuffer[0], 4, USB_SetupPacket.Length);
+        /* Deferred once the ops are in */
+        VectorResultsLength = 0;
+        USB_EP0SetupDataOut(&VectorOps[0], APP_VECTOR_SIZE, USB_SetupPacket.Length);
         return TRUE;
 
-    case APP_REQUEST_WRITE:
-        USB_EP0SetupDataOut(&DataBuffer[0], 4, USB_SetupPacket.Length);
+    case APP_REQUEST_VECTOR_RESULTS:
+        USB_EP0SetupDataIn(&VectorResults[0], VectorResultsLength, USB_SetupPacket.Length);
         return TRUE;
 
     case APP_REQUEST_GPIO_CONFIGURE:
@@ -254,7 +408,26 @@ BOOL USB_EP0SetupVendorRequestHandler(void)
         return TRUE;
 
     case APP_REQUEST_GET_STATUS:
-        USB_EP0SetupDataIn(&OpResult, 1, USB_SetupPacket.Length);
+        /* Result of the last transaction, then its WAIT retry count */
+        StatusBuffer[0] = (uint8_t)OpResult;
+        StatusBuffer[1] = cmd_swd_wait_retries();
+        USB_EP0SetupDataIn(&StatusBuffer[0], 2, USB_SetupPacket.Length);
+        return TRUE;
+
+    case APP_REQUEST_SET_WAIT_RETRY:
+        /* Value: max retries on WAIT; Index: idle cycles before the first retry, doubled on every retry */
+        if (cmd_swd_set_wait_retry(USB_SetupPacket.Value.Raw, USB_SetupPacket.Index.Raw)) {
+            return FALSE;
+        }
+        USB_EP0ArmForStatusIn();
+        return TRUE;
+
+    case APP_REQUEST_SET_RECOVERY:
+        /* Value: CMD_RECOVERY_* policies */
+        if (cmd_swd_set_recovery(USB_SetupPacket.Value.Raw)) {
+            return FALSE;
+        }
+        USB_EP0ArmForStatusIn();
         return TRUE;
 
     default:
@@ -268,12 +441,13 @@ BOOL USB_EP0OutTransferCompletionHandler(void)
     if (USB_SetupPacket.RequestType.Type == USB_REQUEST_VENDOR) {
         switch (USB_SetupPacket.Request) {
         case APP_REQUEST_WRITE:
-            OpResult = cmd_swd_write(USB_SetupPacket.Value.Raw & 0xFF, &DataBuffer[0]);
-            if (OpResult) {
-                led_activity(1);
-                return FALSE;
-            }
-            return TRUE;
+            USB_EP0DeferStatus();
+            return USB_EP0DeferRequest();
+
+        case APP_REQUEST_VECTOR:
+            VectorOpsLength = USB_SetupPacket.Length;
+            USB_EP0DeferStatus();
+            return USB_EP0DeferRequest();
 
         default:
             break;
@@ -281,3 +455,132 @@ BOOL USB_EP0OutTransferCompletionHandler(void)
     }
     return USB_EP0OutTransferCompletionStdHandler();
 }
+
+/*
+ Runs the pending request, if any. Returns FALSE to stall; *Length is the amount of data
+ to return from DataBuffer, 0 for a status stage only.
+ */
+static BOOL USB_EP0ExecuteRequest(uint8_t Request, uint16_t Value, uint16_t Index, uint16_t *Length)
+{
+    *Length = 0;
+    if ((Request & APP_REQUEST_TRANSFER_MASK) == APP_REQUEST_TRANSFER) {
+        uint32_t *Data = (uint32_t *)&DataBuffer[4];
+        uint8_t Status;
+        if (Request & CMD_REQUEST_RnW) {
+            Status = cmd_swd_read(Request & ~APP_REQUEST_TRANSFER_MASK, Data);
+        } else {
+            *Data = Value | ((uint32_t)Index << 16);
+            Status = cmd_swd_write(Request & ~APP_REQUEST_TRANSFER_MASK, Data);
+            *Data = 0;
+        }
+        OpResult = Status;
+        DataBuffer[0] = Status;
+        DataBuffer[1] = cmd_swd_wait_retries();
+        DataBuffer[2] = 0;
+        DataBuffer[3] = 0;
+        *Length = APP_TRANSFER_RESPONSE_SIZE;
+        return TRUE;
+    }
+    switch (Request) {
+
+    case APP_REQUEST_CONFIGURE_SWJ:
+        cmd_swd_enable(!!Value);
+        return TRUE;
+
+    case APP_REQUEST_SWITCH_TO_SWD:
+        cmd_switch_to_swd();
+        return TRUE;
+
+    case APP_REQUEST_READ:
+        OpResult = cmd_swd_read(Value & 0xFF, &DataBuffer[0]);
+        if (OpResult) {
+            return FALSE;
+        }
+        /* The data is followed by the WAIT retry count; hosts asking for 4 bytes do not get it */
+        DataBuffer[4] = cmd_swd_wait_retries();
+        *Length = 5;
+        return TRUE;
+
+    case APP_REQUEST_WRITE:
+        OpResult = cmd_swd_write(Value & 0xFF, &DataBuffer[0]);
+        if (OpResult) {
+            led_activity(1);
+            return FALSE;
+        }
+        return TRUE;
+
+    case APP_REQUEST_VECTOR:
+        /* Never stalls: failures are reported with the results */
+        VectorResultsLength = 1 + cmd_swd_batch(&VectorOps[0], VectorOpsLength, Value,
+            &VectorResults[1], sizeof(VectorResults) - 1, &VectorResults[0]);
+        OpResult = VectorResults[0];
+        return TRUE;
+
+    case APP_REQUEST_SET_SWD_TIMING:
+        /* Value: speed index; Index: idle cycles; returns the measured SWCLK frequency */
+        if (cmd_swd_set_timing(Value, Index, &DataBuffer[0])) {
+            return FALSE;
+        }
+        *Length = 4;
+        return TRUE;
+
+    case APP_REQUEST_BENCHMARK_SWD:
+        if (Value == APP_BENCHMARK_DMA) {
+            /* Returns the sustained bits per second of the DMA write engine */
+            if (cmd_swd_benchmark_dma(&DataBuffer[0])) {
+                return FALSE;
+            }
+            *Length = 4;
+            return TRUE;
+        }
+        /* Returns the cycles per DPIDR read: plain bit loops, fastest engine */
+        cmd_swd_benchmark(&DataBuffer[0]);
+        *Length = 8;
+        return TRUE;
+
+    default:
+        break;
+    }
+    return FALSE;
+}
+
+void USB_EP0Execute(void)
+{
+    uint8_t Request;
+    uint16_t Value;
+    uint16_t Index;
+    uint16_t Length;
+    BOOL Result;
+    BOOL DataIn;
+
+    if (!APP_EP0Pending) {
+        return;
+    }
+    NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+    APP_EP0Pending = FALSE;
+    /* The host has given up on the request and sent another one: its buffers may be half overwritten */
+    if (USB_EP0SetupCount != APP_EP0PendingSetup) {
+        NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+        return;
+    }
+    Request = APP_EP0PendingRequest;
+    Value = APP_EP0PendingValue;
+    Index = APP_EP0PendingIndex;
+    DataIn = APP_EP0PendingDataIn;
+    NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+
+    Result = USB_EP0ExecuteRequest(Request, Value, Index, &Length);
+
+    NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+    /* Nothing to answer if the host has given up on the request and sent another one */
+    if (USB_EP0SetupCount == APP_EP0PendingSetup) {
+        if (!Result) {
+            USB_EP0Stall();
+        } else if (DataIn) {
+            USB_EP0SetupDataIn(&DataBuffer[0], Length, APP_EP0PendingLength);
+        } else {
+            USB_EP0ArmForStatusIn();
+        }
+    }
+    NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+}
@@ -16,6 +16,10 @@ BOOL USB_EP0ZLPNeeded;
 uint16_t USB_DeviceStatus = 0;
 /* Current configuration set for the device */
 uint8_t USB_DeviceConfiguration = 0;
+/* Counts SETUP packets, so deferred handling can tell it was overtaken by a new request */
+volatile uint8_t USB_EP0SetupCount;
+/* The application completes the status stage of the current OUT transfer itself */
+static BOOL USB_EP0StatusDeferred;
 
 void USB_EP0Stall(void)
 {
@@ -79,6 +83,11 @@ void USB_EP0SetupDataIn(const void *Buffer, uint16_t AvailableCount, uint16_t Re
     USB_SetEPRxStatus(0, USB_EPxR_STAT_RX_VALID);
 }
 
+void USB_EP0DeferStatus(void)
+{
+    USB_EP0StatusDeferred = TRUE;
+}
+
 BOOL USB_EP0OutTransferCompletionHandler(void) __attribute__((weak, alias("USB_EP0OutTransferCompletionStdHandler")));
 BOOL USB_EP0OutTransferCompletionStdHandler(void)
 {
@@ -253,6 +262,8 @@ void USB_EP0SetupHandler(void)
     BOOL Result = FALSE;
     /* Save the packet */
     USB_EndpointToUserMemcpy(0, USB_EP_BUFFER_RX, &USB_SetupPacket, sizeof(USB_SetupPacket));
+    USB_EP0SetupCount++;
+    USB_EP0StatusDeferred = FALSE;
     DEBUG_PrintString("SETUP: "); DEBUG_PrintHex(&USB_SetupPacket, sizeof(USB_SetupPacket));
     /* Set the endpoint to NAK any further packets */
     USB_SetEPRxTxStatus(0, USB_EPxR_STAT_RX_NAK | USB_EPxR_STAT_TX_NAK);
@@ -301,8 +312,10 @@ void USB_EP0OutHandler(void)
         if (USB_EP0TxRxCount == 0) {
             /* Transfer complete */
             if (USB_EP0OutTransferCompletionHandler()) {
-                /* Arm for the status stage */
-                USB_EP0ArmForStatusIn();
+                /* Arm for the status stage, unless the application does it later */
+                if (!USB_EP0StatusDeferred) {
+                    USB_EP0ArmForStatusIn();
+                }
             } else {
                 /* Stall the status stage */
                 USB_EP0Stall();
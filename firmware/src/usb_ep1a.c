@@ -0,0 +1,510 @@
+#include "usb_core.h"
+#include "debug.h"
+#include "commands.h"
+
+/******************************************************************************/
+/* Bulk endpoint 1 handling code -- application specific                      */
+/******************************************************************************/
+
+/*
+ Every bulk OUT transfer carries one command: a header followed by the payload.
+ Every command is answered by one bulk IN transfer: a header followed by the results.
+ The response is terminated with a short packet, so the host may over-read.
+ The Status byte of a command carries its flags (see CMD_BATCH_*).
+
+ The USB interrupt only moves packets: complete commands are queued into a ring of slots,
+ which the main loop executes in order. While one command clocks out on the wire,
+ the next ones are being received; the OUT endpoint NAKs once the ring is full.
+ Responses are sent one at a time from a single buffer.
+ */
+typedef struct {
+    uint8_t Command;
+    uint8_t Status;
+    uint16_t Length;
+} __attribute__((packed)) APP_BulkHeader;
+
+#define APP_COMMAND_BATCH 1
+#define APP_COMMAND_READ_MEM_BLOCK 2
+#define APP_COMMAND_WRITE_MEM_BLOCK 3
+#define APP_COMMAND_SAMPLE_MEM 4
+#define APP_COMMAND_WATCH_HALT 5
+#define APP_COMMAND_POLL_MEM 6
+#define APP_COMMAND_FLASH_PROGRAM 7
+
+#define APP_COMMAND_BUFFER_SIZE 1024
+#define APP_RESPONSE_BUFFER_SIZE 1024
+/* Power of 2 */
+#define APP_COMMAND_SLOTS 4
+
+typedef struct {
+    /* Receives the header and the payload */
+    uint8_t Data[APP_COMMAND_BUFFER_SIZE] __attribute__((aligned(4)));
+    uint16_t Count;
+    /* Bytes of the command which did not fit into the buffer; set to 1 for malformed transfers */
+    uint16_t Discarded;
+    /* The payload past the parameters is consumed in place as it arrives */
+    BOOL Streaming;
+    /*
+     More packets of the payload follow the first one. No other command is received
+     until they are all consumed, so they are always those of the command being executed.
+     */
+    BOOL StreamPackets;
+} APP_CommandSlot;
+
+static APP_CommandSlot CommandRing[APP_COMMAND_SLOTS];
+/* Free running counts of the commands queued by the interrupt and executed by the main loop */
+static volatile uint8_t CommandsQueued;
+static volatile uint8_t CommandsExecuted;
+/* The interrupt left the OUT endpoint NAKing; the main loop re-arms it */
+static volatile BOOL CommandRxHeld;
+/* Bumped on every (re)configuration, so the main loop drops what it was doing */
+static volatile uint8_t CommandEpoch;
+
+/*
+ Streamed payload: the OUT packets following the first one of a streaming command
+ are left in the packet memory until the main loop consumes them.
+ */
+static volatile BOOL StreamActive;
+static volatile BOOL StreamPacketPending;
+static volatile uint16_t StreamPacketSize;
+static uint32_t StreamReceived;
+static uint32_t StreamExpected;
+/* Bytes of the payload the command being executed may still consume; main loop only */
+static uint32_t StreamRemaining;
+
+/* Response buffer: holds the header and the results */
+static uint8_t ResponseBuffer[APP_RESPONSE_BUFFER_SIZE] __attribute__((aligned(4)));
+static const uint8_t *ResponseData;
+static uint16_t ResponseCount;
+static BOOL ResponseZLPNeeded;
+/* Set by the main loop when a response starts, cleared by the interrupt once it is sent */
+static volatile BOOL ResponseBusy;
+/* Long responses are produced by the main loop in place into the packet memory, one packet at a time */
+typedef unsigned (*APP_ResponseProducer)(USB_PMAWord *Buffer, unsigned Size);
+static volatile BOOL ResponseProducing;
+static volatile BOOL ResponsePacketSent;
+/* Streamed payloads are consumed by the main loop in place from the packet memory */
+typedef void (*APP_StreamConsumer)(const volatile uint32_t *Buffer, unsigned Length);
+
+static inline void USB_EP1Lock(void)
+{
+    NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+}
+
+static inline void USB_EP1Unlock(void)
+{
+    NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+}
+
+/* Arms the OUT endpoint if the next packet has somewhere to go; otherwise holds it NAKing */
+static void USB_EP1ArmOut(void)
+{
+    BOOL Room;
+    if (StreamActive) {
+        Room = !StreamPacketPending;
+    } else {
+        Room = (uint8_t)(CommandsQueued - CommandsExecuted) < APP_COMMAND_SLOTS;
+    }
+    if (Room) {
+        CommandRxHeld = FALSE;
+        USB_SetEPRxStatus(1, USB_EPxR_STAT_RX_VALID);
+    } else {
+        CommandRxHeld = TRUE;
+    }
+}
+
+static APP_CommandSlot *USB_EP1ReceivingSlot(void)
+{
+    return &CommandRing[CommandsQueued & (APP_COMMAND_SLOTS - 1)];
+}
+
+/* Hands the slot being received over to the main loop */
+static void USB_EP1QueueCommand(void)
+{
+    APP_CommandSlot *Slot;
+    CommandsQueued++;
+    Slot = USB_EP1ReceivingSlot();
+    Slot->Count = 0;
+    Slot->Discarded = 0;
+    Slot->Streaming = FALSE;
+    Slot->StreamPackets = FALSE;
+}
+
+static void USB_EP1DataInStage(void)
+{
+    uint16_t Transferred;
+    Transferred = ResponseCount > USB_EP1_SIZE ? USB_EP1_SIZE : ResponseCount;
+    /* Transfer the data */
+    USB_UserToEndpointMemcpy(1, USB_EP_BUFFER_TX, ResponseData, Transferred);
+    ResponseData += Transferred;
+    ResponseCount -= Transferred;
+    /* Arm the endpoint */
+    USB_SetEPTxStatus(1, USB_EPxR_STAT_TX_VALID);
+}
+
+/* Waits for the interrupt to finish sending the previous response; FALSE if the device was reconfigured */
+static BOOL USB_EP1WaitResponseSent(uint8_t Epoch)
+{
+    while (ResponseBusy) {
+        if (CommandEpoch != Epoch) {
+            return FALSE;
+        }
+    }
+    return CommandEpoch == Epoch;
+}
+
+static void USB_EP1SendResponse(uint8_t Command, uint8_t Status, uint16_t Length, uint8_t Epoch)
+{
+    APP_BulkHeader *Header = (APP_BulkHeader *)&ResponseBuffer[0];
+    Header->Command = Command;
+    Header->Status = Status;
+    Header->Length = Length;
+    USB_EP1Lock();
+    if (CommandEpoch != Epoch) {
+        /* The host has moved on */
+        USB_EP1Unlock();
+        return;
+    }
+    ResponseBusy = TRUE;
+    ResponseProducing = FALSE;
+    ResponseData = &ResponseBuffer[0];
+    ResponseCount = sizeof(APP_BulkHeader) + Length;
+    /* A full-sized last packet has to be followed by a ZLP */
+    ResponseZLPNeeded = (ResponseCount & (USB_EP1_SIZE - 1)) == 0;
+    USB_EP1DataInStage();
+    USB_EP1Unlock();
+}
+
+/* Arms the IN endpoint with a packet produced in place and waits for it to go out */
+static BOOL USB_EP1SendProducedPacket(uint16_t Count, uint8_t Epoch)
+{
+    USB_EP1Lock();
+    ResponsePacketSent = FALSE;
+    USB_SetTxCount(1, USB_EP_BUFFER_TX, Count);
+    USB_SetEPTxStatus(1, USB_EPxR_STAT_TX_VALID);
+    USB_EP1Unlock();
+    while (!ResponsePacketSent) {
+        if (CommandEpoch != Epoch) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ Sends a response longer than the buffer. The producer has to fill the packet
+ completely every time, except for the last part, so the packets stay full-sized.
+ */
+static void USB_EP1SendLongResponse(uint8_t Command, uint16_t Length, APP_ResponseProducer Producer, uint8_t Epoch)
+{
+    USB_PMAWord *Packet = USB_GetTxBuffer(1, USB_EP_BUFFER_TX);
+    uint16_t Produced;
+
+    ResponseBusy = TRUE;
+    ResponseProducing = TRUE;
+    /* The header goes in place too: Command, Status, Length */
+    Packet[0] = Command | (CMD_STATUS_OK << 8);
+    Packet[1] = Length;
+    Produced = sizeof(APP_BulkHeader) + Producer(&Packet[sizeof(APP_BulkHeader) / 2], USB_EP1_SIZE - sizeof(APP_BulkHeader));
+    while (Produced) {
+        if (!USB_EP1SendProducedPacket(Produced, Epoch)) {
+            return;
+        }
+        Produced = Producer(USB_GetTxBuffer(1, USB_EP_BUFFER_TX), USB_EP1_SIZE);
+    }
+    /* A full-sized last packet has to be followed by a ZLP */
+    if (((sizeof(APP_BulkHeader) + Length) & (USB_EP1_SIZE - 1)) == 0) {
+        if (!USB_EP1SendProducedPacket(0, Epoch)) {
+            return;
+        }
+    }
+    ResponseProducing = FALSE;
+    ResponseBusy = FALSE;
+}
+
+/* Clamps a piece of the streamed payload to what the command asked for; nothing once it is discarded */
+static unsigned USB_EP1StreamTake(const APP_CommandSlot *Slot, unsigned Length)
+{
+    if (Slot->Discarded) {
+        StreamRemaining = 0;
+    }
+    if (Length > StreamRemaining) {
+        Length = StreamRemaining;
+    }
+    StreamRemaining -= Length;
+    return Length;
+}
+
+/* Consumes the streamed payload of the command being executed, packet by packet */
+static BOOL USB_EP1ConsumeStream(const APP_CommandSlot *Slot, APP_StreamConsumer Consumer, uint8_t Epoch)
+{
+    unsigned Length;
+    for (;;) {
+        while (!StreamPacketPending) {
+            if (!StreamActive) {
+                return TRUE;
+            }
+            if (CommandEpoch != Epoch) {
+                return FALSE;
+            }
+        }
+        Length = USB_EP1StreamTake(Slot, StreamPacketSize);
+        if (Length) {
+            Consumer(USB_GetRxBuffer(1, USB_EP_BUFFER_RX), Length);
+        }
+        USB_EP1Lock();
+        StreamPacketPending = FALSE;
+        if (CommandRxHeld) {
+            USB_EP1ArmOut();
+        }
+        USB_EP1Unlock();
+    }
+}
+
+/* Size of the parameters preceding the streamed payload; 0 if the command is not streamed */
+static uint16_t USB_EP1StreamParamsSize(uint8_t Command)
+{
+    switch (Command) {
+    case APP_COMMAND_WRITE_MEM_BLOCK:
+        return CMD_MEM_PARAMS_SIZE;
+    case APP_COMMAND_FLASH_PROGRAM:
+        return CMD_FLASH_PARAMS_SIZE;
+    default:
+        return 0;
+    }
+}
+
+static void USB_EP1DispatchCommand(APP_CommandSlot *Slot, uint8_t Epoch)
+{
+    const APP_BulkHeader *Header = (const APP_BulkHeader *)&Slot->Data[0];
+    uint8_t *Results = &ResponseBuffer[sizeof(APP_BulkHeader)];
+    const unsigned ResultsSize = sizeof(ResponseBuffer) - sizeof(APP_BulkHeader);
+    const uint8_t *Payload = &Slot->Data[sizeof(APP_BulkHeader)];
+    uint8_t Status = CMD_STATUS_OK;
+    uint16_t Length = 0;
+
+    DEBUG_PrintString("CMD "); DEBUG_PrintU8(Header->Command);
+    if (Slot->Streaming) {
+        /* The data is written as it arrives; the first packet is in the slot */
+        const uint16_t Start = sizeof(APP_BulkHeader) + USB_EP1StreamParamsSize(Header->Command);
+        APP_StreamConsumer Consumer;
+        unsigned First;
+        /* An overlong first packet or a short length has the slot discarded already: nothing is taken */
+        StreamRemaining = sizeof(APP_BulkHeader) + Header->Length - Start;
+        First = USB_EP1StreamTake(Slot, Slot->Count - Start);
+        if (Header->Command == APP_COMMAND_FLASH_PROGRAM) {
+            cmd_flash_program_begin(Payload, Header->Length);
+            cmd_flash_program_consume(&Slot->Data[Start], First);
+            Consumer = cmd_flash_program_consume_pma;
+        } else {
+            cmd_swd_mem_write_begin(Payload, Header->Length);
+            cmd_swd_mem_write_consume(&Slot->Data[Start], First);
+            Consumer = cmd_swd_mem_write_consume_pma;
+        }
+        if (Slot->StreamPackets && !USB_EP1ConsumeStream(Slot, Consumer, Epoch)) {
+            return;
+        }
+    }
+    if (Slot->Discarded) {
+        USB_EP1SendResponse(Header->Command, CMD_STATUS_MALFORMED, 0, Epoch);
+        return;
+    }
+
+    switch (Header->Command) {
+    case APP_COMMAND_BATCH:
+        Length = cmd_swd_batch(Payload, Header->Length, Header->Status, Results, ResultsSize, &Status);
+        break;
+
+    case APP_COMMAND_READ_MEM_BLOCK:
+        /* The data follows as it is read, then a trailer with the status */
+        Status = cmd_swd_mem_read_begin(Payload, Header->Length, &Length);
+        if (Status == CMD_STATUS_OK) {
+            USB_EP1SendLongResponse(Header->Command, Length, cmd_swd_mem_read_produce, Epoch);
+            return;
+        }
+        break;
+
+    case APP_COMMAND_WRITE_MEM_BLOCK:
+        /* The data has been written as it arrived */
+        if (!Slot->Streaming) {
+            Status = CMD_STATUS_MALFORMED;
+            break;
+        }
+        Length = cmd_swd_mem_write_end(Results, &Status);
+        break;
+
+    case APP_COMMAND_FLASH_PROGRAM:
+        /* The data has been programmed as it arrived; the results are the page statuses */
+        if (!Slot->Streaming) {
+            Status = CMD_STATUS_MALFORMED;
+            break;
+        }
+        Length = cmd_flash_program_end(Results, &Status);
+        break;
+
+    case APP_COMMAND_SAMPLE_MEM:
+        /* The samples go out on endpoint 2 */
+        Status = cmd_swd_sample_begin(Payload, Header->Length);
+        break;
+
+    case APP_COMMAND_POLL_MEM:
+        Length = cmd_swd_poll_mem(Payload, Header->Length, Results, &Status);
+        break;
+
+    case APP_COMMAND_WATCH_HALT:
+        /* The events go out on endpoint 4; those of an earlier watch are stale */
+        USB_EP1Lock();
+        USB_EP4EventFlush();
+        USB_EP1Unlock();
+        Status = cmd_swd_watch_begin(Payload, Header->Length);
+        break;
+
+    default:
+        Status = CMD_STATUS_MALFORMED;
+        break;
+    }
+    USB_EP1SendResponse(Header->Command, Status, Length, Epoch);
+}
+
+/* Executes the next queued command, if any; called from the main loop */
+void USB_EP1Execute(void)
+{
+    const uint8_t Epoch = CommandEpoch;
+
+    if (CommandsExecuted == CommandsQueued) {
+        return;
+    }
+    if (!USB_EP1WaitResponseSent(Epoch)) {
+        return;
+    }
+    USB_EP1DispatchCommand(&CommandRing[CommandsExecuted & (APP_COMMAND_SLOTS - 1)], Epoch);
+    USB_EP1Lock();
+    if (CommandEpoch == Epoch) {
+        CommandsExecuted++;
+        if (CommandRxHeld) {
+            USB_EP1ArmOut();
+        }
+    }
+    USB_EP1Unlock();
+}
+
+static void USB_EP1StreamOutHandler(uint16_t Received)
+{
+    /* Left in the packet memory for the main loop, which re-arms the endpoint */
+    StreamPacketSize = Received;
+    StreamPacketPending = TRUE;
+    CommandRxHeld = TRUE;
+    StreamReceived += Received;
+    if (StreamReceived >= StreamExpected || Received < USB_EP1_SIZE) {
+        if (StreamReceived != StreamExpected) {
+            /* Truncated or overlong transfer; the streaming command is the last queued one */
+            CommandRing[(uint8_t)(CommandsQueued - 1) & (APP_COMMAND_SLOTS - 1)].Discarded = 1;
+        }
+        StreamActive = FALSE;
+    }
+}
+
+static void USB_EP1OutHandler(void)
+{
+    APP_CommandSlot *Slot = USB_EP1ReceivingSlot();
+    uint16_t Received = USB_GetRxCount(1, USB_EP_BUFFER_RX);
+    uint16_t Transferred;
+    uint32_t Expected;
+    const APP_BulkHeader *Header;
+
+    if (StreamActive) {
+        USB_EP1StreamOutHandler(Received);
+        return;
+    }
+    /* Transfer the data into the slot */
+    Transferred = USB_EndpointToUserMemcpy(1, USB_EP_BUFFER_RX, &Slot->Data[Slot->Count], sizeof(Slot->Data) - Slot->Count);
+    Slot->Count += Transferred;
+    Slot->Discarded += Received - Transferred;
+    if (Slot->Count < sizeof(APP_BulkHeader)) {
+        /* A short packet without a complete header: drop it */
+        if (Received < USB_EP1_SIZE) {
+            Slot->Count = 0;
+        }
+        USB_EP1ArmOut();
+        return;
+    }
+    Header = (const APP_BulkHeader *)&Slot->Data[0];
+    Expected = sizeof(APP_BulkHeader) + Header->Length;
+    if (USB_EP1StreamParamsSize(Header->Command) && !Slot->Discarded &&
+        Slot->Count >= sizeof(APP_BulkHeader) + USB_EP1StreamParamsSize(Header->Command)) {
+        /* Queued right away: the rest of the payload is consumed in place as it arrives */
+        Slot->Streaming = TRUE;
+        StreamReceived = Slot->Count;
+        StreamExpected = Expected;
+        StreamActive = StreamReceived < StreamExpected && Received == USB_EP1_SIZE;
+        Slot->StreamPackets = StreamActive;
+        if (!StreamActive && StreamReceived != StreamExpected) {
+            Slot->Discarded = 1;
+        }
+        USB_EP1QueueCommand();
+        USB_EP1ArmOut();
+        return;
+    }
+    if (Slot->Count + Slot->Discarded < Expected && Received == USB_EP1_SIZE) {
+        /* More to come */
+        USB_EP1ArmOut();
+        return;
+    }
+    if (Slot->Count + Slot->Discarded != Expected) {
+        /* Truncated or overlong transfer */
+        Slot->Discarded = 1;
+    }
+    USB_EP1QueueCommand();
+    USB_EP1ArmOut();
+}
+
+static void USB_EP1InHandler(void)
+{
+    if (ResponseProducing) {
+        /* The main loop produces the next packet */
+        ResponsePacketSent = TRUE;
+        return;
+    }
+    if (ResponseCount > 0) {
+        USB_EP1DataInStage();
+    } else if (ResponseZLPNeeded) {
+        ResponseZLPNeeded = FALSE;
+        USB_EP1DataInStage();
+    } else {
+        /* Response sent; the next one may go */
+        ResponseBusy = FALSE;
+    }
+}
+
+void USB_EP1Configure(void)
+{
+    APP_CommandSlot *Slot;
+    /* Drop whatever was queued or in progress */
+    CommandEpoch++;
+    CommandsExecuted = CommandsQueued;
+    Slot = USB_EP1ReceivingSlot();
+    Slot->Count = 0;
+    Slot->Discarded = 0;
+    Slot->Streaming = FALSE;
+    Slot->StreamPackets = FALSE;
+    StreamActive = FALSE;
+    StreamPacketPending = FALSE;
+    ResponseBusy = FALSE;
+    ResponseProducing = FALSE;
+    /* The buffers are set up by the core; the IN side NAKs until there is a response */
+    USB_EP1ArmOut();
+}
+
+void USB_EP1Handler(USB_EventType Event)
+{
+    switch (Event) {
+    case USB_OUT_EVENT:
+        USB_EP1OutHandler();
+        break;
+    case USB_IN_EVENT:
+        USB_EP1InHandler();
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,97 @@
+#include "usb_core.h"
+#include "debug.h"
+
+/******************************************************************************/
+/* Streaming endpoint 2 handling code -- application specific                 */
+/******************************************************************************/
+
+/*
+ Endpoint 2 is a double-buffered bulk IN endpoint carrying a continuous stream of records.
+ Every packet starts with the amount of records dropped so far (16 bits, wrapping),
+ followed by whole records; records are never split across packets.
+ Records are gathered in RAM, then copied into the PMA buffer owned by the application,
+ which is handed over as soon as the hardware is done with the other one.
+ When both PMA buffers and the RAM packet are full, new records are dropped and counted.
+ */
+
+#define APP_STREAM_HEADER_SIZE 2
+
+static uint8_t StreamPacket[USB_EP2_SIZE] __attribute__((aligned(2)));
+static unsigned StreamCount;
+static uint16_t StreamDropped;
+/* The application buffer is filled and waits for the hardware to finish the other one */
+static BOOL StreamPending;
+
+/* Copies the packet into the application buffer and hands it over if possible */
+static void USB_EP2StreamSubmit(void)
+{
+    StreamPacket[0] = (uint8_t)StreamDropped;
+    StreamPacket[1] = (uint8_t)(StreamDropped >> 8);
+    USB_UserToEndpointMemcpy(2, USB_GetEPTxAppBuffer(2), &StreamPacket[0], StreamCount);
+    StreamCount = APP_STREAM_HEADER_SIZE;
+    if (USB_IsEPTxHardwareWaiting(2)) {
+        USB_ReleaseEPTxAppBuffer(2);
+    } else {
+        StreamPending = TRUE;
+    }
+}
+
+/*
+ Queues a record; to be called with the USB interrupt masked.
+ Returns FALSE if the record had to be dropped.
+ */
+BOOL USB_EP2StreamWrite(const void *Record, unsigned Length)
+{
+    const uint8_t *Data = (const uint8_t *)Record;
+
+    /* The endpoint is disabled until the device is configured, and again after a reset */
+    if (USB_GetEPTxStatus(2) != USB_EPxR_STAT_TX_VALID || Length > USB_EP2_SIZE - APP_STREAM_HEADER_SIZE) {
+        return FALSE;
+    }
+    if (StreamCount + Length > USB_EP2_SIZE) {
+        if (StreamPending) {
+            /* The host does not keep up */
+            StreamDropped++;
+            return FALSE;
+        }
+        USB_EP2StreamSubmit();
+    }
+    while (Length--) {
+        StreamPacket[StreamCount++] = *Data++;
+    }
+    /* Do not hold the data back while the host is waiting for it */
+    if (!StreamPending && USB_IsEPTxHardwareWaiting(2)) {
+        USB_EP2StreamSubmit();
+    }
+    return TRUE;
+}
+
+static void USB_EP2InHandler(void)
+{
+    /* The hardware has moved on to the pending buffer, if any, and freed the other one */
+    if (StreamPending) {
+        StreamPending = FALSE;
+        USB_ReleaseEPTxAppBuffer(2);
+    }
+    if (StreamCount > APP_STREAM_HEADER_SIZE) {
+        USB_EP2StreamSubmit();
+    }
+}
+
+void USB_EP2Configure(void)
+{
+    StreamCount = APP_STREAM_HEADER_SIZE;
+    StreamDropped = 0;
+    StreamPending = FALSE;
+}
+
+void USB_EP2Handler(USB_EventType Event)
+{
+    switch (Event) {
+    case USB_IN_EVENT:
+        USB_EP2InHandler();
+        break;
+    default:
+        break;
+    }
+}
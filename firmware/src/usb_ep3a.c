@@ -0,0 +1,142 @@
+#include "usb_core.h"
+#include "debug.h"
+#include "dap.h"
+
+/******************************************************************************/
+/* CMSIS-DAP bulk endpoint 3 handling code -- application specific            */
+/******************************************************************************/
+
+/*
+ Every bulk OUT packet carries one CMSIS-DAP request, every response goes in one bulk IN packet.
+ Requests are queued into a ring of DAP_PACKET_COUNT packets, which the main loop executes
+ in order, so the host may keep that many in flight; the OUT endpoint NAKs once the ring is full.
+ DAP_TransferAbort is not queued: it stops the transfers queued or running right away.
+ */
+
+#if DAP_PACKET_SIZE != USB_EP3_SIZE
+#error "A CMSIS-DAP packet has to fit a USB packet"
+#endif
+
+typedef struct {
+    uint8_t Data[DAP_PACKET_SIZE];
+    uint16_t Count;
+} APP_DAPSlot;
+
+static APP_DAPSlot DAPRing[DAP_PACKET_COUNT];
+/* Free running counts of the requests queued by the interrupt and executed by the main loop */
+static volatile uint8_t DAPQueued;
+static volatile uint8_t DAPExecuted;
+/* The interrupt left the OUT endpoint NAKing; the main loop re-arms it */
+static volatile BOOL DAPRxHeld;
+/* Bumped on every (re)configuration, so the main loop drops what it was doing */
+static volatile uint8_t DAPEpoch;
+
+static uint8_t DAPResponse[DAP_PACKET_SIZE];
+/* Set by the main loop when a response goes out, cleared by the interrupt once it is sent */
+static volatile BOOL DAPResponseBusy;
+
+static inline void USB_EP3Lock(void)
+{
+    NVIC_DisableIRQ(USB_LP_CAN1_RX0_IRQn);
+}
+
+static inline void USB_EP3Unlock(void)
+{
+    NVIC_EnableIRQ(USB_LP_CAN1_RX0_IRQn);
+}
+
+/* Arms the OUT endpoint if the next packet has somewhere to go; otherwise holds it NAKing */
+static void USB_EP3ArmOut(void)
+{
+    if ((uint8_t)(DAPQueued - DAPExecuted) < DAP_PACKET_COUNT) {
+        DAPRxHeld = FALSE;
+        USB_SetEPRxStatus(3, USB_EPxR_STAT_RX_VALID);
+    } else {
+        DAPRxHeld = TRUE;
+    }
+}
+
+/* Executes the next queued request, if any; called from the main loop */
+void USB_EP3Execute(void)
+{
+    const uint8_t Epoch = DAPEpoch;
+    APP_DAPSlot *Slot;
+    unsigned Length;
+
+    if (DAPExecuted == DAPQueued) {
+        return;
+    }
+    /* The response buffer is reused */
+    while (DAPResponseBusy) {
+        if (DAPEpoch != Epoch) {
+            return;
+        }
+    }
+    Slot = &DAPRing[DAPExecuted & (DAP_PACKET_COUNT - 1)];
+    DEBUG_PrintString("DAP "); DEBUG_PrintU8(Slot->Data[0]);
+    Length = dap_execute(&Slot->Data[0], Slot->Count, &DAPResponse[0], sizeof(DAPResponse));
+
+    USB_EP3Lock();
+    if (DAPEpoch == Epoch) {
+        if (Length) {
+            DAPResponseBusy = TRUE;
+            USB_UserToEndpointMemcpy(3, USB_EP_BUFFER_TX, &DAPResponse[0], Length);
+            USB_SetEPTxStatus(3, USB_EPxR_STAT_TX_VALID);
+        }
+        DAPExecuted++;
+        if (DAPExecuted == DAPQueued) {
+            /* Whatever was aborted is done */
+            dap_transfer_abort = 0;
+        }
+        if (DAPRxHeld) {
+            USB_EP3ArmOut();
+        }
+    }
+    USB_EP3Unlock();
+}
+
+static void USB_EP3OutHandler(void)
+{
+    APP_DAPSlot *Slot = &DAPRing[DAPQueued & (DAP_PACKET_COUNT - 1)];
+
+    Slot->Count = USB_EndpointToUserMemcpy(3, USB_EP_BUFFER_RX, &Slot->Data[0], sizeof(Slot->Data));
+    if (Slot->Count && Slot->Data[0] == DAP_CMD_TRANSFER_ABORT) {
+        /* Only meaningful with transfers pending; it has no response */
+        if (DAPQueued != DAPExecuted) {
+            dap_transfer_abort = 1;
+        }
+    } else if (Slot->Count) {
+        DAPQueued++;
+    }
+    USB_EP3ArmOut();
+}
+
+static void USB_EP3InHandler(void)
+{
+    DAPResponseBusy = FALSE;
+}
+
+void USB_EP3Configure(void)
+{
+    /* Drop whatever was queued or in progress */
+    DAPEpoch++;
+    DAPExecuted = DAPQueued;
+    DAPResponseBusy = FALSE;
+    dap_transfer_abort = 0;
+    /* The buffers are set up by the core; the IN side NAKs until there is a response */
+    USB_EP3ArmOut();
+}
+
+void USB_EP3Handler(USB_EventType Event)
+{
+    switch (Event) {
+    case USB_OUT_EVENT:
+        USB_EP3OutHandler();
+        break;
+    case USB_IN_EVENT:
+        USB_EP3InHandler();
+        break;
+    default:
+        break;
+    }
+}
@@ -0,0 +1,82 @@
+#include "usb_core.h"
+#include "debug.h"
+
+/******************************************************************************/
+/* Event endpoint 4 handling code -- application specific                     */
+/******************************************************************************/
+
+/*
+ Endpoint 4 is an interrupt IN endpoint carrying target events, one per packet.
+ Nothing is sent until an event occurs, so the host may wait on it for free.
+ An event still waiting for the host is replaced by a newer one: events carry a state.
+ */
+
+static uint8_t EventPacket[USB_EP4_SIZE] __attribute__((aligned(2)));
+static unsigned EventLength;
+/* A newer event waits for the previous one to go out */
+static BOOL EventPending;
+
+static void USB_EP4EventSubmit(void)
+{
+    USB_UserToEndpointMemcpy(4, USB_EP_BUFFER_TX, &EventPacket[0], EventLength);
+    USB_SetEPTxStatus(4, USB_EPxR_STAT_TX_VALID);
+}
+
+/*
+ Queues an event; to be called with the USB interrupt masked.
+ Returns FALSE if the endpoint is not configured.
+ */
+BOOL USB_EP4EventWrite(const void *Event, unsigned Length)
+{
+    const uint8_t *Data = (const uint8_t *)Event;
+    unsigned Index;
+
+    if (USB_GetEPTxStatus(4) == USB_EPxR_STAT_TX_DIS || Length > USB_EP4_SIZE) {
+        return FALSE;
+    }
+    /* Gathered in RAM first: the packet memory is copied in halfwords */
+    for (Index = 0; Index < Length; ++Index) {
+        EventPacket[Index] = Data[Index];
+    }
+    EventLength = Length;
+    if (USB_GetEPTxStatus(4) == USB_EPxR_STAT_TX_VALID) {
+        /* The previous one is still in the packet memory */
+        EventPending = TRUE;
+    } else {
+        USB_EP4EventSubmit();
+    }
+    return TRUE;
+}
+
+/* Drops the events not sent yet; to be called with the USB interrupt masked */
+void USB_EP4EventFlush(void)
+{
+    EventPending = FALSE;
+    if (USB_GetEPTxStatus(4) == USB_EPxR_STAT_TX_VALID) {
+        USB_SetEPTxStatus(4, USB_EPxR_STAT_TX_NAK);
+    }
+}
+
+static void USB_EP4InHandler(void)
+{
+    if (EventPending) {
+        EventPending = FALSE;
+        USB_EP4EventSubmit();
+    }
+}
+
+void USB_EP4Configure(void)
+{
+    EventPending = FALSE;
+}
+
+void USB_EP4Handler(USB_EventType Event)
+{
+    switch (Event) {
+    case USB_IN_EVENT:
+        USB_EP4InHandler();
+        break;
+    default:
+        break;
+    }
+}
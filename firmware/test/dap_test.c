@@ -0,0 +1,319 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include "swd.h"
+#include "dap.h"
+
+/*
+ Host test of the CMSIS-DAP command processor (dap.c).
+ The SWD layer is simulated: a DP with posted AP reads in front of a MEM-AP over a small memory.
+ */
+
+#define SIM_MEMORY_WORDS 64
+
+/* DP registers, A[3:2] */
+#define SIM_DP_ABORT 0x0
+#define SIM_DP_CTRLSTAT 0x4
+#define SIM_DP_SELECT 0x8
+#define SIM_DP_RDBUFF 0xC
+/* MEM-AP registers */
+#define SIM_AP_CSW 0x0
+#define SIM_AP_TAR 0x4
+#define SIM_AP_DRW 0xC
+
+static uint32_t sim_memory[SIM_MEMORY_WORDS];
+static uint32_t sim_tar;
+static uint32_t sim_ctrlstat;
+static uint32_t sim_rdbuff;
+/* Request of the transaction whose data phase comes next */
+static uint8_t sim_request;
+static swd_response_t sim_response;
+/* Transactions seen, and the one to be answered with FAULT (0: none) */
+static unsigned sim_transactions;
+static unsigned sim_fault_at;
+/* WAITs to answer before the next transaction goes through */
+static unsigned sim_waits;
+
+static void sim_reset(void)
+{
+    unsigned n;
+
+    for (n = 0; n < SIM_MEMORY_WORDS; ++n)
+        sim_memory[n] = 0x10000000 + n;
+    sim_tar = 0;
+    sim_ctrlstat = 0;
+    sim_rdbuff = 0;
+    sim_transactions = 0;
+    sim_fault_at = 0;
+    sim_waits = 0;
+}
+
+static uint32_t sim_drw_read(void)
+{
+    uint32_t value = sim_memory[(sim_tar / 4) % SIM_MEMORY_WORDS];
+
+    sim_tar += 4;
+    return value;
+}
+
+/* SWD layer */
+
+int parity_even_4bit(uint8_t bits)
+{
+    return (0x6996U >> bits) & 1;
+}
+
+void swd_enable(int enabled)
+{
+    (void)enabled;
+}
+
+int swd_set_timing(unsigned speed, unsigned idle_cycles)
+{
+    return speed < SWD_SPEED_COUNT && idle_cycles <= SWD_IDLE_CYCLES_MAX;
+}
+
+uint32_t swd_measure_frequency(void)
+{
+    return 1000000;
+}
+
+void swd_turnaround(int writing)
+{
+    (void)writing;
+}
+
+void swd_idle_cycles(void)
+{
+}
+
+void swd_bits_out(uint32_t bits, unsigned count)
+{
+    (void)bits;
+    (void)count;
+}
+
+void swd_delay_us(unsigned us)
+{
+    (void)us;
+}
+
+swd_response_t swd_request_response(uint8_t request)
+{
+    const uint8_t bits = (request >> 1) & 0xF;
+
+    /* Start, parity, stop and park */
+    if ((request & 0xC1) != 0x81 || ((request >> 5) & 1) != parity_even_4bit(bits))
+        return SWD_PROTOCOL_ERROR;
+    if (sim_waits) {
+        sim_waits--;
+        return SWD_RESPONSE_WAIT;
+    }
+    sim_request = bits;
+    sim_response = ++sim_transactions == sim_fault_at ? SWD_RESPONSE_FAULT : SWD_RESPONSE_OK;
+    return sim_response;
+}
+
+int swd_data_read(uint32_t *value)
+{
+    const unsigned a = sim_request & 0xC;
+
+    if (sim_request & 1) {
+        /* Posted: the data is that of the previous AP read */
+        *value = sim_rdbuff;
+        sim_rdbuff = a == SIM_AP_DRW ? sim_drw_read() : a == SIM_AP_TAR ? sim_tar : 0;
+    } else if (a == SIM_DP_RDBUFF) {
+        *value = sim_rdbuff;
+    } else if (a == SIM_DP_CTRLSTAT) {
+        *value = sim_ctrlstat;
+    } else {
+        *value = 0x2BA01477;
+    }
+    return 1;
+}
+
+void swd_data_write(uint32_t value)
+{
+    const unsigned a = sim_request & 0xC;
+
+    if (!(sim_request & 1)) {
+        if (a == SIM_DP_CTRLSTAT)
+            sim_ctrlstat = value;
+    } else if (a == SIM_AP_TAR) {
+        sim_tar = value;
+    } else if (a == SIM_AP_DRW) {
+        sim_memory[(sim_tar / 4) % SIM_MEMORY_WORDS] = value;
+        sim_tar += 4;
+    }
+}
+
+/* Tests */
+
+/* Transfer request bytes */
+#define REQ_DP_READ(a) (0x02 | ((a) & 0xC))
+#define REQ_AP_READ(a) (0x03 | ((a) & 0xC))
+#define REQ_AP_WRITE(a) (0x01 | ((a) & 0xC))
+
+static unsigned failures;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            printf("%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+static uint32_t get32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static unsigned put32(uint8_t *p, uint32_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+    return 4;
+}
+
+static void test_info(void)
+{
+    const uint8_t request[] = { DAP_CMD_INFO, 0xFF };
+    uint8_t response[DAP_PACKET_SIZE];
+    unsigned length;
+
+    length = dap_execute(request, sizeof(request), response, sizeof(response));
+    CHECK(length == 4);
+    CHECK(response[0] == DAP_CMD_INFO && response[1] == 2);
+    CHECK((response[2] | (response[3] << 8)) == DAP_PACKET_SIZE);
+}
+
+/* AP reads come back in order although each one is posted */
+static void test_transfer_posted_reads(void)
+{
+    uint8_t request[DAP_PACKET_SIZE];
+    uint8_t response[DAP_PACKET_SIZE];
+    unsigned length = 0;
+    unsigned n;
+
+    sim_reset();
+    request[length++] = DAP_CMD_TRANSFER;
+    request[length++] = 0;
+    request[length++] = 5;
+    request[length++] = REQ_AP_WRITE(SIM_AP_TAR);
+    length += put32(&request[length], 8);
+    request[length++] = REQ_AP_READ(SIM_AP_DRW);
+    request[length++] = REQ_AP_READ(SIM_AP_DRW);
+    request[length++] = REQ_AP_READ(SIM_AP_DRW);
+    request[length++] = REQ_DP_READ(SIM_DP_CTRLSTAT);
+    sim_ctrlstat = 0xF0000000;
+
+    length = dap_execute(request, length, response, sizeof(response));
+    CHECK(length == 3 + 4 * 4);
+    CHECK(response[1] == 5 && response[2] == 0x01);
+    for (n = 0; n < 3; ++n)
+        CHECK(get32(&response[3 + n * 4]) == sim_memory[2 + n]);
+    CHECK(get32(&response[3 + 3 * 4]) == 0xF0000000);
+}
+
+/* A FAULT stops the transfers; the count tells which ones were done */
+static void test_transfer_fault(void)
+{
+    uint8_t request[DAP_PACKET_SIZE];
+    uint8_t response[DAP_PACKET_SIZE];
+    unsigned length = 0;
+
+    sim_reset();
+    /* The TAR write and the first DRW write go through */
+    sim_fault_at = 3;
+    request[length++] = DAP_CMD_TRANSFER;
+    request[length++] = 0;
+    request[length++] = 3;
+    request[length++] = REQ_AP_WRITE(SIM_AP_TAR);
+    length += put32(&request[length], 0);
+    request[length++] = REQ_AP_WRITE(SIM_AP_DRW);
+    length += put32(&request[length], 0xCAFEF00D);
+    request[length++] = REQ_AP_WRITE(SIM_AP_DRW);
+    length += put32(&request[length], 0xDEADBEEF);
+
+    length = dap_execute(request, length, response, sizeof(response));
+    CHECK(length == 3);
+    CHECK(response[1] == 2 && response[2] == 0x04);
+    CHECK(sim_memory[0] == 0xCAFEF00D);
+    CHECK(sim_memory[1] == 0x10000001);
+}
+
+/* WAITs are retried as configured */
+static void test_transfer_wait(void)
+{
+    const uint8_t request[] = { DAP_CMD_TRANSFER, 0, 1, REQ_DP_READ(SIM_DP_CTRLSTAT) };
+    uint8_t response[DAP_PACKET_SIZE];
+    unsigned length;
+
+    sim_reset();
+    sim_waits = 3;
+    sim_ctrlstat = 0x12345678;
+    length = dap_execute(request, sizeof(request), response, sizeof(response));
+    CHECK(length == 7);
+    CHECK(response[1] == 1 && response[2] == 0x01);
+    CHECK(get32(&response[3]) == 0x12345678);
+}
+
+/* More read data than the response takes: the transfers stop where the data ends */
+static void test_transfer_response_full(void)
+{
+    uint8_t request[DAP_PACKET_SIZE];
+    uint8_t response[DAP_PACKET_SIZE];
+    unsigned length = 0;
+    unsigned n;
+
+    sim_reset();
+    request[length++] = DAP_CMD_TRANSFER;
+    request[length++] = 0;
+    request[length++] = 20;
+    for (n = 0; n < 20; ++n)
+        request[length++] = REQ_AP_READ(SIM_AP_DRW);
+
+    /* Header plus room for 15 words and change */
+    length = dap_execute(request, length, response, 3 + 15 * 4 + 1);
+    CHECK(response[1] == 15);
+    CHECK(response[2] == 0x08);
+    CHECK(length == 3 + 15 * 4);
+    for (n = 0; n < 15; ++n)
+        CHECK(get32(&response[3 + n * 4]) == sim_memory[n]);
+}
+
+static void test_transfer_block_read(void)
+{
+    const uint8_t request[] = { DAP_CMD_TRANSFER_BLOCK, 0, 20, 0, REQ_AP_READ(SIM_AP_DRW) };
+    uint8_t response[DAP_PACKET_SIZE];
+    unsigned length;
+    unsigned n;
+
+    sim_reset();
+    /* 15 words fit after the header */
+    length = dap_execute(request, sizeof(request), response, sizeof(response));
+    CHECK(length == 4 + 15 * 4);
+    CHECK((response[1] | (response[2] << 8)) == 15);
+    CHECK(response[3] == 0x08);
+    for (n = 0; n < 15; ++n)
+        CHECK(get32(&response[4 + n * 4]) == sim_memory[n]);
+}
+
+int main(void)
+{
+    test_info();
+    test_transfer_posted_reads();
+    test_transfer_fault();
+    test_transfer_wait();
+    test_transfer_response_full();
+    test_transfer_block_read();
+    if (failures) {
+        printf("%u failures\n", failures);
+        return 1;
+    }
+    printf("OK\n");
+    return 0;
+}
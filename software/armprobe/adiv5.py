@@ -2,7 +2,9 @@
 ADI v5 Debug and Access Port wrappers
 """
 
+import struct
 from bitfield import BitField
+from probe import SWDException
 
 #
 # Debug Port
@@ -158,6 +160,77 @@ class SWDebugPort(DebugPort):
         self.set_select(dpbank=0)
         self._write_reg(1, long(DPCTRLSTAT(**kwds)))
 
+    def clear_sticky(self):
+        """Clears all the sticky flags via ABORT"""
+        self.set_abort(sticky_cmp=1, sticky_err=1, wdata_err=1, sticky_orun=1)
+
+    def stream(self, ops):
+        """Execute raw transactions in overrun detection streaming mode
+
+        Each op is a tuple (is_read, is_ap, a32, data), as for the probe batches.
+        Returns the data of the reads and the amount of ops done before the first failure.
+        A run cut short by an overrun (WAIT) only clears the sticky flags, so the caller
+        can replay the tail; errors raise SWDException.
+        ORUNDETECT is only on for the run: the probe's other paths do not clock
+        the data phase after WAIT/FAULT, as overrun detection requires.
+        """
+        saved = self.get_ctrlstat()
+        value = DPCTRLSTAT(long(saved))
+        value.overrun_detect = 1
+        # The run turns it on, and back to what it was as its last op
+        count = len(ops)
+        ops = [(False, False, 1, long(value))] + ops + [(False, False, 1, long(saved))]
+        restored = False
+        try:
+            values, completed, ctrlstat, status = self.transport.execute_stream(ops)
+            value = DPCTRLSTAT(ctrlstat)
+            if status or value.sticky_orun or value.sticky_err or value.wdata_err:
+                self.clear_sticky()
+            restored = completed == len(ops)
+        finally:
+            if not restored:
+                self._write_reg(1, long(saved))
+        if value.sticky_err or value.wdata_err:
+            raise SWDException(4)
+        if status not in (0, 2, 4):
+            raise SWDException(status)
+        return values, min(max(completed - 1, 0), count)
+
+    def stream_pushed(self, ops, mode=DebugPort.TRANSFER_MODE_PUSHED_VERIFY, masklane=0xF):
+        """Execute raw transactions in streaming mode, with the AP writes turned into pushed operations
+
+        The DP reads the AP register back instead of each write, and compares the byte lanes set
+        in masklane against the value (pushed verify: mismatch, pushed compare: match).
+        TAR auto-increments as for plain accesses.
+        Returns the amount of ops done before the first failure, and whether a comparison hit (STICKYCMP).
+        The transfer mode, MASKLANE and ORUNDETECT are only set for the run, as for stream().
+        A hit makes the rest of the run FAULT, restoring CTRL/STAT included: only ABORT goes
+        through until the sticky flags are cleared.
+        """
+        saved = self.get_ctrlstat()
+        value = DPCTRLSTAT(long(saved))
+        value.overrun_detect = 1
+        value.transfer_mode = mode
+        value.masklane = masklane
+        count = len(ops)
+        ops = [(False, False, 1, long(value))] + ops + [(False, False, 1, long(saved))]
+        restored = False
+        try:
+            # The probe reads CTRL/STAT once the last operation is over
+            _, completed, ctrlstat, status = self.transport.execute_stream(ops)
+            value = DPCTRLSTAT(ctrlstat)
+            if status or value.sticky_orun or value.sticky_err or value.wdata_err or value.sticky_cmp:
+                self.clear_sticky()
+            restored = completed == len(ops)
+        finally:
+            if not restored:
+                self._write_reg(1, long(saved))
+        if value.sticky_err or value.wdata_err:
+            raise SWDException(4)
+        if status not in (0, 2, 4):
+            raise SWDException(status)
+        return min(max(completed - 1, 0), count), bool(value.sticky_cmp)
+
     def set_select(self, **kwds):
         """Writes the SELECT register"""
         value = DPSELECT(self._cached_select, **kwds)
@@ -173,6 +246,52 @@ class SWDebugPort(DebugPort):
         """Reads the RDBUFF register"""
         return self._read_reg(3)
 
+    def _probe_selects(self, apsel):
+        """The commands the probe runs on its own select bank 0 of their AP; keeps the cached SELECT in step"""
+        self._cached_select = DPSELECT(apsel=apsel)
+
+    def read_mem_block(self, apsel, address, length, size):
+        """Reads a block of memory through a MEM-AP, the probe doing all the transactions"""
+        self._probe_selects(apsel)
+        return self.transport.read_mem_block(apsel, address, length, size)
+
+    def write_mem_block(self, apsel, address, data, size, packed=False):
+        """Writes a block of memory through a MEM-AP, the probe doing all the transactions"""
+        self._probe_selects(apsel)
+        return self.transport.write_mem_block(apsel, address, data, size, packed)
+
+    def program_flash(self, apsel, address, data, page_size, erase, fpec_base):
+        """Programs STM32F1 flash through a MEM-AP, the probe doing all the transactions"""
+        self._probe_selects(apsel)
+        return self.transport.program_flash(apsel, address, data, page_size, erase, fpec_base)
+
+    def poll_mem(self, apsel, address, mask, expected, timeout_ms, max_iterations):
+        """Polls a memory word through a MEM-AP until it matches, the probe doing all the transactions"""
+        self._probe_selects(apsel)
+        return self.transport.poll_mem(apsel, address, mask, expected, timeout_ms, max_iterations)
+
+    def start_sampling(self, apsel, address, interval_us):
+        """Starts sampling a memory word through a MEM-AP; nothing else may access the target until it stops"""
+        self._probe_selects(apsel)
+        self.transport.start_sampling(apsel, address, interval_us)
+
+    def stop_sampling(self):
+        """Stops sampling"""
+        self.transport.stop_sampling()
+
+    def start_watch(self, apsel, address, interval_us):
+        """Starts watching DHCSR through a MEM-AP; nothing else may access the target until it stops"""
+        self._probe_selects(apsel)
+        self.transport.start_watch(apsel, address, interval_us)
+
+    def stop_watch(self):
+        """Stops watching DHCSR"""
+        self.transport.stop_watch()
+
+    def read_watch_event(self, timeout=None):
+        """Waits for the watched DHCSR to change; returns it, or None on timeout"""
+        return self.transport.read_watch_event(timeout)
+
     def ap_read(self, apsel, address, pipelined=False):
         """Execute a AP read transaction via SWD-DP"""
         regno = (address & 0xFF) >> 2
@@ -325,6 +444,7 @@ class MemoryAccessPort(AccessPort):
     def __init__(self, debug_port, apsel):
         super(MemoryAccessPort, self).__init__(debug_port, apsel)
         self._cache_clear()
+        self._packed_supported = None
 
     def _cache_clear(self):
         self._cached_csw = None
@@ -425,6 +545,163 @@ class MemoryAccessPort(AccessPort):
         results.append(bytelaning_get(address, value, size_bits))
         return results
 
+    # Streamed runs in a row which may make no progress
+    STREAM_MAX_STALLS = 8
+
+    def _stream_stalled(self, done, stalls):
+        """Counts the streamed runs without progress, giving up after too many"""
+        if done:
+            return 0
+        stalls += 1
+        if stalls > MemoryAccessPort.STREAM_MAX_STALLS:
+            raise SWDException(2)
+        return stalls
+
+    def read_mem_stream(self, address, count, size=CSW_SIZE_WORD):
+        """Reads multiple locations from memory in overrun detection streaming mode
+
+        The ACKs are checked once per run; a run cut short by WAIT is replayed from the first location missed.
+        Runs are split at 1KB boundaries, as TAR auto-increment may stop there.
+        """
+        size_bits = MemoryAccessPort.csw_size_to_bits[size]
+        size_bytes = size_bits >> 3
+        self.set_csw(addrinc=MemoryAccessPort.CSW_ADDRINC_SINGLE, size=size)
+        results = []
+        stalls = 0
+        while count:
+            run = min(count, (0x400 - (address & 0x3FF)) // size_bytes)
+            self.dp.set_select(apsel=self.apsel, apbank=0)
+            # TAR, DRW reads; each read returns the previous one, the last one is in RDBUFF
+            ops = [(False, True, 1, address)] + [(True, True, 3, 0)] * run + [(True, False, 3, 0)]
+            values, completed = self.dp.stream(ops)
+            done = min(run, max(completed - 2, 0))
+            for value in values[1:1 + done]:
+                results.append(bytelaning_get(address, value, size_bits))
+                address += size_bytes
+            count -= done
+            stalls = self._stream_stalled(done, stalls)
+        return results
+
+    def write_mem_stream(self, address, values, size=CSW_SIZE_WORD):
+        """Writes multiple locations to memory in overrun detection streaming mode
+
+        The ACKs are checked once per run; a run cut short by WAIT is replayed from the first location missed.
+        Runs are split at 1KB boundaries, as TAR auto-increment may stop there.
+        """
+        size_bits = MemoryAccessPort.csw_size_to_bits[size]
+        size_bytes = size_bits >> 3
+        self.set_csw(addrinc=MemoryAccessPort.CSW_ADDRINC_SINGLE, size=size)
+        index = 0
+        stalls = 0
+        while index < len(values):
+            run = min(len(values) - index, (0x400 - (address & 0x3FF)) // size_bytes)
+            self.dp.set_select(apsel=self.apsel, apbank=0)
+            ops = [(False, True, 1, address)]
+            for offset in xrange(run):
+                lane_address = address + offset * size_bytes
+                ops.append((False, True, 3, bytelaning_set(lane_address, values[index + offset], size_bits)))
+            _, completed = self.dp.stream(ops)
+            done = min(run, max(completed - 1, 0))
+            address += done * size_bytes
+            index += done
+            stalls = self._stream_stalled(done, stalls)
+
+    def verify_mem_pushed(self, address, values):
+        """Compares memory words against the expected values with the DP doing pushed verify; returns the first mismatch address or None
+
+        Only the expected values go out: nothing is read back unless a mismatch is found.
+        Runs are split at 1KB boundaries, as TAR is set before each run with the pushed mode off.
+        Words only: MASKLANE is set once for the run, so the byte lanes cannot follow the address.
+        """
+        size = MemoryAccessPort.CSW_SIZE_WORD
+        if address & 3:
+            raise ValueError("pushed verify needs a word aligned address")
+        self.set_csw(addrinc=MemoryAccessPort.CSW_ADDRINC_SINGLE, size=size)
+        index = 0
+        stalls = 0
+        while index < len(values):
+            run = min(len(values) - index, (0x400 - (address & 0x3FF)) // 4)
+            self.set_tar(address)
+            self.dp.set_select(apsel=self.apsel, apbank=0)
+            ops = [(False, True, 3, value) for value in values[index:index + run]]
+            done, mismatch = self.dp.stream_pushed(ops)
+            if mismatch:
+                return self._find_mismatch(address, values[index:index + run], size)
+            done = min(run, done)
+            address += done * 4
+            index += done
+            stalls = self._stream_stalled(done, stalls)
+        return None
+
+    def _find_mismatch(self, address, values, size):
+        """Locates the mismatch found by pushed verify in a run starting at address"""
+        size_bytes = MemoryAccessPort.csw_size_to_bits[size] >> 3
+        # The operations after the mismatch failed, so TAR is left past the mismatching location
+        candidate = self.get_tar() - size_bytes
+        index = (candidate - address) // size_bytes
+        if 0 <= index < len(values) and self.read_mem_single(candidate, size) != values[index]:
+            return candidate
+        # Should TAR not tell, read the run back
+        for index, value in enumerate(self.read_mem_block(address, len(values), size)):
+            if value != values[index]:
+                return address + index * size_bytes
+        return None
+
+    def _probe_changes_csw(self):
+        """The commands the probe runs on its own leave CSW as they need it; drops the cached value"""
+        self._cached_csw = None
+
+    def read_mem_block(self, address, count, size=CSW_SIZE_WORD):
+        """Reads multiple locations from memory, the probe doing all the transactions"""
+        size_bytes = MemoryAccessPort.csw_size_to_bits[size] >> 3
+        self._probe_changes_csw()
+        data = self.dp.read_mem_block(self.apsel, address, count * size_bytes, size)
+        format = "<" + "BHI"[size] * count
+        return list(struct.unpack(format, data))
+
+    def supports_packed(self):
+        """Checks whether the MEM-AP takes packed transfers (CSW AddrInc reads back as written)"""
+        if self._packed_supported is None:
+            self.set_csw(addrinc=MemoryAccessPort.CSW_ADDRINC_PACKED)
+            self._packed_supported = self.get_csw().addrinc == MemoryAccessPort.CSW_ADDRINC_PACKED
+        return self._packed_supported
+
+    def write_mem_block(self, address, values, size=CSW_SIZE_WORD):
+        """Writes multiple locations to memory, the probe doing all the transactions"""
+        data = struct.pack("<" + "BHI"[size] * len(values), *values)
+        # Word aligned byte/halfword blocks go packed when the MEM-AP takes it
+        packed = size < MemoryAccessPort.CSW_SIZE_WORD and ((address | len(data)) & 3) == 0 and self.supports_packed()
+        self._probe_changes_csw()
+        self.dp.write_mem_block(self.apsel, address, data, size, packed)
+
+    def program_flash(self, address, data, page_size, erase, fpec_base):
+        """Programs STM32F1 flash pages, the probe driving the FPEC; returns the status of every page"""
+        self._probe_changes_csw()
+        return self.dp.program_flash(self.apsel, address, data, page_size, erase, fpec_base)
+
+    def poll_mem_word(self, address, mask, expected, timeout_ms=1000, max_iterations=0):
+        """Reads a memory word until (value & mask) == expected; returns (matched, value, iterations)"""
+        self._probe_changes_csw()
+        return self.dp.poll_mem(self.apsel, address, mask, expected, timeout_ms, max_iterations)
+
+    def start_sampling(self, address, interval_us):
+        """Starts sampling a memory word every interval_us; read the samples with the probe's read_samples()"""
+        self._probe_changes_csw()
+        self.dp.start_sampling(self.apsel, address, interval_us)
+
+    def start_watch(self, address, interval_us):
+        """Starts watching DHCSR at address every interval_us; read the changes with read_watch_event()"""
+        self._probe_changes_csw()
+        self.dp.start_watch(self.apsel, address, interval_us)
+
+    def stop_watch(self):
+        """Stops watching DHCSR"""
+        self.dp.stop_watch()
+
+    def read_watch_event(self, timeout=None):
+        """Waits for the watched DHCSR to change; returns it, or None on timeout"""
+        return self.dp.read_watch_event(timeout)
+
     def read_mem_words(self, address, count):
         """Shortcut to read multiple word-sized locations from memory"""
         return self.read_mem_multiple(address, count, MemoryAccessPort.CSW_SIZE_WORD)
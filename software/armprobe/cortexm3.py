@@ -2,6 +2,7 @@
 Cortex-M3 Core Debug
 """
 
+import time
 from bitfield import BitField
 
 class DHCSR(BitField):
@@ -122,6 +123,26 @@ class CoreDebug(object):
         value = DHCSR(self._get_dhcsr() & 0x0000FFFF, **kwds)
         return self.ap.write_mem_word(self.base + 0xDF0, long(value) | 0xA05F0000)
 
+    def wait_for_halt(self, timeout=None, interval_us=100):
+        """Waits for the core to halt or lock up, the probe watching DHCSR; returns DHCSR, or None after timeout ms"""
+        deadline = None if timeout is None else time.time() + timeout / 1000.0
+        self.ap.start_watch(self.base + 0xDF0, interval_us)
+        try:
+            while True:
+                remaining = None
+                if deadline is not None:
+                    remaining = int((deadline - time.time()) * 1000)
+                    if remaining <= 0:
+                        return None
+                value = self.ap.read_watch_event(remaining)
+                if value is None:
+                    return None
+                dhcsr = DHCSR(value)
+                if dhcsr.halted or dhcsr.lockup:
+                    return dhcsr
+        finally:
+            self.ap.stop_watch()
+
     def set_dcrsr(self, **kwds):
         """Writes the Debug Core Register Selector Register (DCRSR)"""
         value = DCRSR(**kwds)
@@ -6,6 +6,8 @@ Blue Pill pin assignments:
 * SWCLK: B13
 * nRST:  B0
 
+Firmware built with SWD_ENGINE=SPI also needs SWDIO on B14 and B15.
+
 """
 
 import usb1
@@ -16,21 +18,84 @@ class ProbeException(Exception):
     pass
 
 class SWDException(Exception):
+    # Set in the status once the probe has recovered from the failure
+    RECOVERED = 0x40
+
     def __init__(self, response):
+        recovered = response != 0xFE and bool(response & SWDException.RECOVERED)
+        if recovered:
+            response &= ~SWDException.RECOVERED
         message = "SWD response returned: %d" % response
         if response == 4:
             message += " -- FAULT"
         elif response == 2:
             message += " -- WAIT"
+        elif response == 7:
+            message += " -- PROTOCOL ERROR"
+        elif response == 8:
+            message += " -- PARITY ERROR"
+        elif response == 0x10:
+            message += " -- TIMEOUT"
+        elif response == 0x20:
+            message += " -- FLASH ERROR"
+        elif response == 0xFE:
+            message += " -- MALFORMED COMMAND"
+        if recovered:
+            message += " (recovered)"
         super(SWDException, self).__init__(message)
         self.response = response
+        self.recovered = recovered
 
 class BluePillProbe(object):
     """ADI version 5 probe wrapper"""
 
+    BULK_OUT_ENDPOINT = 0x01
+    BULK_IN_ENDPOINT = 0x81
+    STREAM_IN_ENDPOINT = 0x82
+    EVENT_IN_ENDPOINT = 0x84
+
+    COMMAND_BATCH = 1
+    COMMAND_READ_MEM_BLOCK = 2
+    COMMAND_WRITE_MEM_BLOCK = 3
+    COMMAND_SAMPLE_MEM = 4
+    COMMAND_WATCH_HALT = 5
+    COMMAND_POLL_MEM = 6
+    COMMAND_FLASH_PROGRAM = 7
+
+    # Flags of COMMAND_BATCH
+    BATCH_DMA_WRITES = 0x01
+    BATCH_REPORT_RETRIES = 0x02
+    BATCH_STREAM = 0x04
+
+    # Stream mode trailer: ops done before the first failure, CTRL/STAT
+    STREAM_TRAILER_SIZE = 6
+    # CTRL/STAT sticky flags: STICKYORUN, STICKYCMP, STICKYERR, WDATAERR
+    STREAM_STICKY_MASK = 0x000000B2
+
+    # Sizes of the firmware buffers, less the header
+    BULK_MAX_COMMAND = 1020
+    BULK_MAX_RESPONSE = 1020
+
+    # Vectored control requests: ops in one packet out, status and results in one packet in
+    REQUEST_VECTOR = 12
+    REQUEST_VECTOR_RESULTS = 13
+    VECTOR_MAX_COMMAND = 64
+    VECTOR_MAX_RESPONSE = 63
+
+    # Largest memory block moved by one command
+    MEM_BLOCK_MAX = 0x8000
+    # Or'ed into the access size for packed transfers
+    MEM_BLOCK_PACKED = 0x80
+
     def __init__(self):
         # TODO: do it right
         self.timeout = 5
+        self.bulk_timeout = 1000
+        # WAIT retries reported for the last transaction or batch
+        self.last_retries = 0
+        # SWCLK frequency and idle cycles as last set; None until set_swd_timing() is called
+        self.swd_frequency = None
+        self.swd_idle_cycles = 9
         self._context = usb1.USBContext()
         self._handle = self._context.openByVendorIDAndProductID(0xDECA, 0x0002, skip_on_error=True)
         if self._handle is None:
@@ -56,6 +121,64 @@ class BluePillProbe(object):
         """Issue the SWJ-DP sequence to switch to SWD"""
         self._handle.controlWrite(0x40, 2, 0x0000, 0x0000, "", self.timeout)
 
+    # Indices into the firmware table of SWCLK bit loops
+    SWD_SPEED_FASTEST = 0
+    SWD_SPEED_DEFAULT = 6
+    SWD_SPEED_SLOWEST = 8
+
+    def set_swd_timing(self, speed=SWD_SPEED_DEFAULT, idle_cycles=9):
+        """Select the SWCLK speed and the idle cycles after each transaction
+
+        Returns the SWCLK frequency in Hz as measured by the probe.
+        """
+        data = self._handle.controlRead(0x40, 8, speed, idle_cycles, 4, self.timeout)
+        self.swd_frequency = struct.unpack("<I", data)[0]
+        self.swd_idle_cycles = idle_cycles
+        return self.swd_frequency
+
+    def benchmark_swd(self):
+        """Count the probe CPU cycles per DPIDR read transaction
+
+        Returns a tuple: cycles with the plain bit loops, cycles with the engine built for the fastest speed.
+        """
+        data = self._handle.controlRead(0x40, 9, 0x0000, 0x0000, 8, self.timeout)
+        return struct.unpack("<II", data)
+
+    def benchmark_swd_dma(self):
+        """Measure the sustained SWCLK rate of the DMA write engine, in bits per second
+
+        The probe streams DP ABORT writes of 0; the firmware has to be built with SWD_DMA=1.
+        The engine runs at the speed set with set_swd_timing(), capped at 2 MHz.
+        """
+        data = self._handle.controlRead(0x40, 9, 0x0001, 0x0000, 4, self.timeout)
+        return struct.unpack("<I", data)[0]
+
+    def set_wait_retry(self, max_retries=0, backoff=0):
+        """Make the probe retry transactions answered with WAIT
+
+        max_retries: up to 255; 0 returns WAIT to the host as before.
+        backoff: idle cycles before the first retry, doubled on every retry, up to 1024.
+        """
+        self._handle.controlWrite(0x40, 10, max_retries, backoff, "", self.timeout)
+
+    # Recovery policies
+    RECOVERY_ABORT = 0x01
+    RECOVERY_RESYNC = 0x02
+
+    def set_recovery(self, abort_on_fault=True, resync_on_error=True):
+        """Make the probe recover from failed transactions by itself
+
+        abort_on_fault: write DP ABORT to clear the sticky flags after a FAULT.
+        resync_on_error: line reset and DPIDR read after a protocol or parity error.
+        A recovered failure still raises SWDException, with recovered set.
+        """
+        policies = 0
+        if abort_on_fault:
+            policies |= BluePillProbe.RECOVERY_ABORT
+        if resync_on_error:
+            policies |= BluePillProbe.RECOVERY_RESYNC
+        self._handle.controlWrite(0x40, 11, policies, 0x0000, "", self.timeout)
+
     @staticmethod
     def _build_request(is_read, is_ap, a32):
         return bool(is_ap) | (bool(is_read) << 1) | ((a32 & 3) << 2)
@@ -76,14 +199,327 @@ class BluePillProbe(object):
         """Execute an AP write transaction via SWD"""
         self._write(True, a32, data)
 
+    # Transfer requests: the SWD request bits are or'ed into the request code
+    REQUEST_TRANSFER = 0x80
+
+    def _transfer(self, request, data=0):
+        """Execute a transaction via SWD; the status comes back with the data, so failures never stall"""
+        response = self._handle.controlRead(0x40, BluePillProbe.REQUEST_TRANSFER | request, data & 0xFFFF, data >> 16, 8, self.timeout)
+        status, self.last_retries, _, value = struct.unpack("<BBHI", response)
+        if status:
+            raise SWDException(status)
+        return value
+
     def _read(self, is_ap, a32):
         """Execute a read transaction via SWD"""
-        data = self._handle.controlRead(0x40, 3, BluePillProbe._build_request(True, is_ap, a32), 0x0000, 4, self.timeout)
-        return struct.unpack("<I", data)[0]
+        return self._transfer(BluePillProbe._build_request(True, is_ap, a32))
 
     def _write(self, is_ap, a32, data):
         """Execute a write transaction via SWD"""
-        self._handle.controlWrite(0x40, 4, BluePillProbe._build_request(False, is_ap, a32), 0x0000, struct.pack("<I", data), self.timeout)
+        self._transfer(BluePillProbe._build_request(False, is_ap, a32), data)
+
+    def _bulk_command(self, command, payload, response_length=BULK_MAX_RESPONSE, flags=0, timeout=None):
+        """Execute a command over the bulk endpoints, returning the status and the results
+
+        The timeout is in milliseconds, 0 waiting forever; bulk_timeout if not given.
+        """
+        if timeout is None:
+            timeout = self.bulk_timeout
+        header = struct.pack("<BBH", command, flags, len(payload))
+        self._handle.bulkWrite(BluePillProbe.BULK_OUT_ENDPOINT, header + payload, timeout)
+        response = self._handle.bulkRead(BluePillProbe.BULK_IN_ENDPOINT, 4 + response_length, timeout)
+        if len(response) < 4:
+            raise ProbeException("short bulk response")
+        response_command, status, length = struct.unpack("<BBH", response[:4])
+        if response_command != command or length != len(response) - 4:
+            raise ProbeException("malformed bulk response")
+        return status, response[4:]
+
+    def _vector_command(self, payload, flags=0):
+        """Execute a vector of ops over the control endpoint, returning the status and the results"""
+        self._handle.controlWrite(0x40, BluePillProbe.REQUEST_VECTOR, flags, 0x0000, payload, self.timeout)
+        response = self._handle.controlRead(0x40, BluePillProbe.REQUEST_VECTOR_RESULTS, 0x0000, 0x0000, 1 + BluePillProbe.VECTOR_MAX_RESPONSE, self.timeout)
+        if len(response) < 1:
+            raise ProbeException("short vector response")
+        return ord(response[0]), response[1:]
+
+    def execute_batch(self, ops, dma_writes=False, report_retries=False, control_only=False):
+        """Execute a list of SWD transactions with as few USB round trips as possible
+
+        Each op is a tuple (is_read, is_ap, a32, data); data is ignored for reads.
+        Returns a list with the data read for read ops and None for write ops.
+        The first failing op raises SWDException with its index and the results so far.
+        With dma_writes, runs of writes are streamed by the DMA engine; this needs
+        CTRL/STAT.ORUNDETECT set, as their ACKs are only checked afterwards.
+        With report_retries, last_retries is set to the total of WAIT retries taken.
+        With control_only, the ops go in vectors over the control endpoint instead of the bulk ones.
+        """
+        if control_only:
+            max_command, max_response = BluePillProbe.VECTOR_MAX_COMMAND, BluePillProbe.VECTOR_MAX_RESPONSE
+        else:
+            max_command, max_response = BluePillProbe.BULK_MAX_COMMAND, BluePillProbe.BULK_MAX_RESPONSE
+        flags = 0
+        if dma_writes:
+            flags |= BluePillProbe.BATCH_DMA_WRITES
+        if report_retries:
+            flags |= BluePillProbe.BATCH_REPORT_RETRIES
+        status_size = 2 if report_retries else 1
+        self.last_retries = 0
+        results = []
+        index = 0
+        while index < len(ops):
+            # Pack as many ops as both firmware buffers can take
+            payload = ""
+            response_length = 0
+            chunk_end = index
+            while chunk_end < len(ops):
+                is_read, is_ap, a32, data = ops[chunk_end]
+                request = BluePillProbe._build_request(is_read, is_ap, a32)
+                if is_read:
+                    op, op_response_length = struct.pack("<B", request), status_size + 4
+                else:
+                    op, op_response_length = struct.pack("<BI", request, data), status_size
+                if len(payload) + len(op) > max_command or response_length + op_response_length > max_response:
+                    break
+                payload += op
+                response_length += op_response_length
+                chunk_end += 1
+            if control_only:
+                status, response = self._vector_command(payload, flags)
+            else:
+                status, response = self._bulk_command(BluePillProbe.COMMAND_BATCH, payload, flags=flags)
+            # Unpack the per-op results
+            offset = 0
+            while offset < len(response):
+                is_read = ops[index][0]
+                op_status = ord(response[offset])
+                if report_retries:
+                    self.last_retries += ord(response[offset + 1])
+                offset += status_size
+                if is_read:
+                    results.append(struct.unpack("<I", response[offset:offset + 4])[0])
+                    offset += 4
+                else:
+                    results.append(None)
+                if op_status:
+                    e = SWDException(op_status)
+                    e.index = index
+                    e.results = results[:-1]
+                    raise e
+                index += 1
+            if status:
+                # The command itself was rejected
+                raise SWDException(status)
+            if index != chunk_end:
+                raise ProbeException("batch terminated early")
+        return results
+
+    def execute_stream(self, ops, dma_writes=False):
+        """Execute a list of SWD transactions without checking each ACK
+
+        Needs CTRL/STAT.ORUNDETECT set: a failed op makes the rest fail too,
+        and is detected from CTRL/STAT read by the probe after each chunk.
+        Each op is a tuple (is_read, is_ap, a32, data); data is ignored for reads.
+        Returns a tuple: the data of the read ops, the amount of ops done before
+        the first failure, CTRL/STAT after the last chunk, the first failure status.
+        The data of the reads after the first failure is not meaningful.
+        """
+        flags = BluePillProbe.BATCH_STREAM
+        if dma_writes:
+            flags |= BluePillProbe.BATCH_DMA_WRITES
+        values = []
+        completed = 0
+        ctrlstat = 0
+        status = 0
+        index = 0
+        while index < len(ops):
+            # Pack as many ops as both firmware buffers can take
+            payload = ""
+            response_length = BluePillProbe.STREAM_TRAILER_SIZE
+            chunk_end = index
+            while chunk_end < len(ops):
+                is_read, is_ap, a32, data = ops[chunk_end]
+                request = BluePillProbe._build_request(is_read, is_ap, a32)
+                if is_read:
+                    op, op_response_length = struct.pack("<B", request), 4
+                else:
+                    op, op_response_length = struct.pack("<BI", request, data), 0
+                if len(payload) + len(op) > BluePillProbe.BULK_MAX_COMMAND or response_length + op_response_length > BluePillProbe.BULK_MAX_RESPONSE:
+                    break
+                payload += op
+                response_length += op_response_length
+                chunk_end += 1
+            status, response = self._bulk_command(BluePillProbe.COMMAND_BATCH, payload, flags=flags)
+            if status == 0xFE or len(response) < BluePillProbe.STREAM_TRAILER_SIZE:
+                raise SWDException(0xFE)
+            trailer = response[-BluePillProbe.STREAM_TRAILER_SIZE:]
+            for offset in xrange(0, len(response) - len(trailer), 4):
+                values.append(struct.unpack("<I", response[offset:offset + 4])[0])
+            chunk_completed, ctrlstat = struct.unpack("<HI", trailer)
+            completed += chunk_completed
+            if status or index + chunk_completed != chunk_end or ctrlstat & BluePillProbe.STREAM_STICKY_MASK:
+                break
+            index = chunk_end
+        return values, completed, ctrlstat, status
+
+    def read_mem_block(self, apsel, address, length, size=2):
+        """Read a block of memory through a MEM-AP, with the probe driving CSW/TAR/DRW
+
+        size is the CSW access size (0: byte, 1: halfword, 2: word); address and length are aligned to it.
+        The probe leaves SELECT pointing at bank 0 of the AP, and changes CSW.
+        Returns the data as a string; a failure raises SWDException with the data read so far.
+        """
+        data = ""
+        while length:
+            chunk = min(length, BluePillProbe.MEM_BLOCK_MAX)
+            payload = struct.pack("<BBHI", apsel, size, chunk, address)
+            status, response = self._bulk_command(BluePillProbe.COMMAND_READ_MEM_BLOCK, payload, chunk + 4)
+            if status:
+                raise SWDException(status)
+            if len(response) != chunk + 4:
+                raise ProbeException("short block read")
+            block_status, _, valid = struct.unpack("<BBH", response[chunk:])
+            data += response[:valid]
+            if block_status:
+                e = SWDException(block_status)
+                e.data = data
+                raise e
+            address += chunk
+            length -= chunk
+        return data
+
+    def write_mem_block(self, apsel, address, data, size=2, packed=False):
+        """Write a block of memory through a MEM-AP, with the probe driving CSW/TAR/DRW"""
+        # The payload is streamed by the probe, so it is not limited by BULK_MAX_COMMAND;
+        # a failure raises SWDException with the amount of bytes written
+        written = 0
+        while written < len(data):
+            chunk = data[written:written + BluePillProbe.MEM_BLOCK_MAX]
+            size_flags = size | (BluePillProbe.MEM_BLOCK_PACKED if packed else 0)
+            payload = struct.pack("<BBHI", apsel, size_flags, len(chunk), address + written) + chunk
+            status, response = self._bulk_command(BluePillProbe.COMMAND_WRITE_MEM_BLOCK, payload, 4)
+            if len(response) != 4:
+                raise SWDException(status or 0xFE)
+            chunk_written = struct.unpack("<I", response)[0]
+            written += chunk_written
+            if status:
+                e = SWDException(status)
+                e.written = written
+                raise e
+        return written
+
+    # Or'ed into the page size of COMMAND_FLASH_PROGRAM to erase each page first
+    FLASH_ERASE = 0x80
+    # Status of a page which failed to erase or program (PGERR, WRPRTERR)
+    STATUS_FLASH_ERROR = 0x20
+    # SWCLK assumed for timeouts until set_swd_timing() tells; below what the slowest speed gives
+    SWD_FREQUENCY_ASSUMED = 100000
+    # Bits of a transaction besides the idle cycles: request, turnarounds, ACK, data and parity
+    SWD_TRANSACTION_BITS = 46
+
+    def program_flash(self, apsel, address, data, page_size=1024, erase=False, fpec_base=0x40022000):
+        """Program STM32F1 flash through a MEM-AP, with the probe driving the FPEC
+
+        address is page aligned, data is a whole number of halfwords; the FPEC has to be unlocked.
+        Every page is programmed on its own: returns the status of every page, 0 for those programmed.
+        """
+        page_bits = page_size.bit_length() - 1
+        statuses = []
+        for offset in xrange(0, len(data), BluePillProbe.MEM_BLOCK_MAX):
+            chunk = data[offset:offset + BluePillProbe.MEM_BLOCK_MAX]
+            pages = (len(chunk) + page_size - 1) // page_size
+            flags = page_bits | (BluePillProbe.FLASH_ERASE if erase else 0)
+            payload = struct.pack("<BBHII", apsel, flags, len(chunk), address + offset, fpec_base) + chunk
+            # Up to 40ms per page erase; per halfword, 70us of programming and at least 5 transactions
+            # (TAR, DRW, then TAR, DRW and RDBUFF polling SR), with twice that as the margin
+            frequency = self.swd_frequency or BluePillProbe.SWD_FREQUENCY_ASSUMED
+            halfword_us = 70 + 5 * (BluePillProbe.SWD_TRANSACTION_BITS + self.swd_idle_cycles) * 1000000 // frequency
+            timeout = self.bulk_timeout + pages * (100 if erase else 0) + len(chunk) // 2 * halfword_us * 2 // 1000
+            status, response = self._bulk_command(BluePillProbe.COMMAND_FLASH_PROGRAM, payload, pages, timeout=timeout)
+            if len(response) != pages:
+                raise SWDException(status or 0xFE)
+            statuses.extend(ord(c) for c in response)
+        return statuses
+
+    # Stream packets: records dropped so far, then the records
+    STREAM_PACKET_SIZE = 64
+    # Memory sample record: timestamp in CPU cycles, value
+    SAMPLE_RECORD_SIZE = 8
+
+    def start_sampling(self, apsel, address, interval_us):
+        """Start sampling a memory word periodically; the probe owns the AP until sampling stops"""
+        payload = struct.pack("<BBHI", apsel, 0, interval_us, address)
+        status, _ = self._bulk_command(BluePillProbe.COMMAND_SAMPLE_MEM, payload, 0)
+        if status:
+            raise SWDException(status)
+
+    def stop_sampling(self):
+        """Stop sampling; raises SWDException if a failure had stopped it already"""
+        payload = struct.pack("<BBHI", 0, 0, 0, 0)
+        status, _ = self._bulk_command(BluePillProbe.COMMAND_SAMPLE_MEM, payload, 0)
+        if status:
+            raise SWDException(status)
+
+    def read_samples(self, timeout=None):
+        """Read a stream packet, returning the records dropped so far (16 bits, wrapping) and a list of (cycles, value)"""
+        packet = self._handle.bulkRead(BluePillProbe.STREAM_IN_ENDPOINT, BluePillProbe.STREAM_PACKET_SIZE, timeout or self.bulk_timeout)
+        if len(packet) < 2:
+            raise ProbeException("short stream packet")
+        dropped = struct.unpack("<H", packet[:2])[0]
+        samples = []
+        for offset in xrange(2, len(packet) - BluePillProbe.SAMPLE_RECORD_SIZE + 1, BluePillProbe.SAMPLE_RECORD_SIZE):
+            samples.append(struct.unpack("<II", packet[offset:offset + BluePillProbe.SAMPLE_RECORD_SIZE]))
+        return dropped, samples
+
+    # Status of COMMAND_POLL_MEM when the value did not match in time
+    STATUS_TIMEOUT = 0x10
+
+    def poll_mem(self, apsel, address, mask, expected, timeout_ms=1000, max_iterations=0):
+        """Read a memory word until (value & mask) == expected, returning (matched, value, iterations)
+
+        A zero timeout_ms or max_iterations means no limit, but not both; the probe does not answer
+        anything else meanwhile, so without timeout_ms the response is waited for indefinitely.
+        """
+        if not timeout_ms and not max_iterations:
+            raise ValueError("poll_mem needs a timeout or an iteration limit")
+        payload = struct.pack("<BBHIIII", apsel, 0, timeout_ms, address, mask, expected, max_iterations)
+        timeout = timeout_ms + self.bulk_timeout if timeout_ms else 0
+        status, response = self._bulk_command(BluePillProbe.COMMAND_POLL_MEM, payload, 8, timeout=timeout)
+        if status and status != BluePillProbe.STATUS_TIMEOUT:
+            raise SWDException(status)
+        value, iterations = struct.unpack("<II", response)
+        return status == 0, value, iterations
+
+    # Halt watch event: status, DHCSR
+    EVENT_SIZE = 8
+
+    def start_watch(self, apsel, address, interval_us):
+        """Start watching DHCSR for halts, lockups and resets; the probe owns the AP until watching stops"""
+        payload = struct.pack("<BBHI", apsel, 0, interval_us, address)
+        status, _ = self._bulk_command(BluePillProbe.COMMAND_WATCH_HALT, payload, 0)
+        if status:
+            raise SWDException(status)
+
+    def stop_watch(self):
+        """Stop watching DHCSR"""
+        payload = struct.pack("<BBHI", 0, 0, 0, 0)
+        status, _ = self._bulk_command(BluePillProbe.COMMAND_WATCH_HALT, payload, 0)
+        if status:
+            raise SWDException(status)
+
+    def read_watch_event(self, timeout=None):
+        """Wait for the DHCSR state to change, returning DHCSR or None on timeout; nothing is polled meanwhile"""
+        try:
+            event = self._handle.interruptRead(BluePillProbe.EVENT_IN_ENDPOINT, BluePillProbe.EVENT_SIZE, timeout or 0)
+        except usb1.USBErrorTimeout:
+            return None
+        if len(event) < BluePillProbe.EVENT_SIZE:
+            raise ProbeException("short event packet")
+        status, _, _, dhcsr = struct.unpack("<BBHI", event)
+        if status:
+            # Watching has stopped
+            raise SWDException(status)
+        return dhcsr
 
     def configure_gpio(self, enabled=True):
         """Configure the GPIO unit (currently only enable/disable)"""
@@ -95,3 +531,8 @@ class BluePillProbe(object):
 
     def get_status(self):
         return self._handle.controlRead(0x40, 7, 0x0000, 0x0000, 1, self.timeout)[0]
+
+    def get_last_retries(self):
+        """Fetch the WAIT retries taken by the last control request transaction"""
+        self.last_retries = ord(self._handle.controlRead(0x40, 7, 0x0000, 0x0000, 2, self.timeout)[1])
+        return self.last_retries
@@ -2,7 +2,12 @@
 STM32F1xx specific code
 """
 
+import hashlib
+import json
+import os
+import struct
 from bitfield import BitField
+from cortexm3 import CoreDebug
 
 class FLASH_ACR(BitField):
     def __init__(self, value=0L, **kwds):
@@ -41,6 +46,83 @@ class FLASH_CR(BitField):
                 "obl_start": (13, 1), # UNDOC
             }, value, **kwds)
 
+class FPECException(Exception):
+    pass
+
+def _crc32_table():
+    table = []
+    for index in xrange(256):
+        crc = index << 24
+        for _ in xrange(8):
+            crc = ((crc << 1) ^ 0x04C11DB7) if crc & 0x80000000 else crc << 1
+        table.append(crc & 0xFFFFFFFF)
+    return table
+
+_CRC32_TABLE = _crc32_table()
+
+def stm32_crc32(data):
+    """Computes the CRC of the data as the STM32 CRC unit does: CRC-32 fed with little endian words, no reflection"""
+    crc = 0xFFFFFFFF
+    data += "\x00" * (-len(data) & 3)
+    for offset in xrange(0, len(data), 4):
+        # The word goes in most significant byte first
+        for byte in reversed(data[offset:offset + 4]):
+            crc = ((crc << 8) & 0xFFFFFFFF) ^ _CRC32_TABLE[(crc >> 24) ^ ord(byte)]
+    return crc
+
+# Thumb code: r0 address, r1 words per page, r2 pages, r3 results, r4 CRC unit base
+_CRC32_CODE = "".join([
+    "\x01\x25",                   # page:   movs  r5, #1
+    "\xa5\x60",                   #         str   r5, [r4, #8]      ; CR.RESET
+    "\x0e\x46",                   #         mov   r6, r1
+    "\x50\xf8\x04\x5b",           # word:   ldr   r5, [r0], #4
+    "\x25\x60",                   #         str   r5, [r4, #0]      ; DR
+    "\x76\x1e",                   #         subs  r6, r6, #1
+    "\xfa\xd1",                   #         bne   word
+    "\x25\x68",                   #         ldr   r5, [r4, #0]
+    "\x43\xf8\x04\x5b",           #         str   r5, [r3], #4
+    "\x52\x1e",                   #         subs  r2, r2, #1
+    "\xf2\xd1",                   #         bne   page
+    "\x00\xbe",                   #         bkpt  #0
+    ])
+
+CRC_BASE = 0x40023000
+RCC_AHBENR = 0x40021014
+RCC_AHBENR_CRCEN = 0x00000040
+
+def target_crc32(ap, address, length, page_size=None, ram=0x20000000, timeout=1000):
+    """Computes the CRC of target memory on the target, with the CRC unit; see stm32_crc32()
+
+    Returns the CRC of the whole range, or with page_size a list of the CRCs of every page.
+    address and length are word aligned. The core is left halted, with its registers and the RCC CRCEN bit changed.
+    """
+    per_page = page_size is not None
+    page_size = page_size or length
+    pages = length // page_size if page_size else 0
+    if (address | length | page_size) & 3 or not pages or length % page_size:
+        raise ValueError("address, length and page size have to be word aligned, length a whole number of pages")
+    core = CoreDebug(ap)
+    results = ram + 0x40
+    core.set_dhcsr(debug_enable=1, halt=1)
+    while not core.get_dhcsr().halted:
+        pass
+    ap.write_mem_word(RCC_AHBENR, ap.read_mem_word(RCC_AHBENR) | RCC_AHBENR_CRCEN)
+    ap.write_mem_block(ram, struct.unpack("<%dI" % (len(_CRC32_CODE) // 4), _CRC32_CODE))
+    for reg, value in enumerate([address, page_size // 4, pages, results, CRC_BASE]):
+        core.write_reg(reg, value)
+    core.write_reg(13, results)
+    core.write_reg(15, ram)
+    # Thumb state
+    core.write_reg(16, 0x01000000)
+    core.set_dhcsr(debug_enable=1, maskints=1, halt=1)
+    core.set_dhcsr(debug_enable=1, maskints=1, halt=0)
+    # The code stops at BKPT
+    if core.wait_for_halt(timeout) is None:
+        core.set_dhcsr(debug_enable=1, halt=1)
+        raise FPECException("CRC computation still running after %d ms" % timeout)
+    crcs = ap.read_mem_block(results, pages)
+    return crcs if per_page else crcs[0]
+
 class FPEC(object):
     """STM32 Flash program and erase controller (FPEC) wrapper"""
 
@@ -79,6 +161,13 @@ class FPEC(object):
     def get_wrpr(self):
         return self.ap.read_mem_word(self.base + 0x020)
 
+    def wait_ready(self, timeout_ms=1000):
+        """Waits for the ongoing operation to end, the probe polling SR; returns SR"""
+        matched, value, _ = self.ap.poll_mem_word(self.base + 0x00C, long(FLASH_SR(busy=1)), 0, timeout_ms)
+        if not matched:
+            raise FPECException("FPEC still busy after %d ms" % timeout_ms)
+        return FLASH_SR(value)
+
     def unlock(self):
         self.set_fpec_keyr(FPEC.KEY1)
         self.set_fpec_keyr(FPEC.KEY2)
@@ -93,39 +182,339 @@ class FPEC(object):
     def erase_option(self):
         self.set_cr(option_erase=1, option_wre=1)
         self.set_cr(option_wre=1, start=1)
-        while self.get_sr().busy:
-            pass
+        self.wait_ready()
 
     def erase_flash_page(self, address):
         self.set_cr(page_erase=1)
         self.set_ar(address)
         self.set_cr(start=1)
-        while self.get_sr().busy:
-            pass
+        self.wait_ready()
 
     def erase_flash(self):
         self.set_cr(mass_erase=1)
         self.set_cr(start=1)
-        while self.get_sr().busy:
-            pass
+        self.wait_ready()
 
     def program_option(self, address, value):
         self.set_cr(option_program=1, option_wre=1)
         self.set_sr(program_err=1)
         self.ap.write_mem_halfword(address, value)
-        while self.get_sr().busy:
-            pass
-        sr = self.get_sr()
-        while sr.busy:
-            sr = self.get_sr()
+        sr = self.wait_ready()
         return not bool(sr.program_err)
 
     def program_flash(self, address, value):
         self.set_cr(page_program=1)
         self.set_sr(program_err=1)
         self.ap.write_mem_halfword(address, value)
-        sr = self.get_sr()
-        while sr.busy:
-            sr = self.get_sr()
+        sr = self.wait_ready()
         return not bool(sr.program_err)
 
+    def program_flash_pages(self, address, data, page_size=1024, erase=True):
+        """Erases and programs whole pages in one go, the probe driving the FPEC; returns the failed page addresses"""
+        if len(data) & 1:
+            data += "\xFF"
+        statuses = self.ap.program_flash(address, data, page_size, erase, self.base)
+        return [address + index * page_size for index, status in enumerate(statuses) if status]
+
+
+def rle_compress(data):
+    """Compresses halfword data for the flash loader; returns the packed halfwords as a string
+
+    Every token is a halfword count, followed by as many literal halfwords,
+    or with bit 15 set by the one halfword the run repeats.
+    """
+    halfwords = struct.unpack("<%dH" % (len(data) // 2), data)
+    packed = []
+    literals = []
+    index = 0
+    while index < len(halfwords):
+        end = index + 1
+        while end < len(halfwords) and halfwords[end] == halfwords[index] and end - index < 0x7FFF:
+            end += 1
+        # A run costs two halfwords, so it takes at least three to pay off
+        if end - index >= 3:
+            if literals:
+                packed += [len(literals)] + literals
+                literals = []
+            packed += [0x8000 | (end - index), halfwords[index]]
+            index = end
+        else:
+            literals.append(halfwords[index])
+            index += 1
+            if len(literals) == 0x7FFF:
+                packed += [len(literals)] + literals
+                literals = []
+    if literals:
+        packed += [len(literals)] + literals
+    return struct.pack("<%dH" % len(packed), *packed)
+
+class FlashLoader(object):
+    """Programs the flash through a loader running from the target SRAM
+
+    The loader takes blocks from two RAM buffers in turn, so the next block goes in while
+    the FPEC programs the current one; the host only polls the completion word of a buffer.
+    """
+
+    # Thumb code; r0 points at the control block: FPEC base, then two block descriptors
+    # (source, destination, flags, status, length, packed data). A nonzero length hands the block over;
+    # a compressed block is expanded from the packed data into the source buffer first.
+    # The loader writes the status (SR error bits), then zeroes the length once it is done.
+    CODE = "".join([
+        "\x01\x68",               # start:  ldr   r1, [r0, #0]
+        "\x02\x1d",               #         adds  r2, r0, #4
+        "\x13\x69",               # wait:   ldr   r3, [r2, #16]
+        "\x00\x2b",               #         cmp   r3, #0
+        "\xfc\xd0",               #         beq   wait
+        "\x14\x68",               #         ldr   r4, [r2, #0]
+        "\x55\x68",               #         ldr   r5, [r2, #4]
+        "\x96\x68",               #         ldr   r6, [r2, #8]
+        "\x16\xf0\x02\x0f",       #         tst   r6, #2          ; compressed
+        "\x1c\xd0",               #         beq   plain
+        "\x57\x69",               #         ldr   r7, [r2, #20]   ; packed data
+        "\xa0\x46",               #         mov   r8, r4
+        "\x04\xeb\x03\x09",       #         add   r9, r4, r3      ; end of the block
+        "\xc8\x45",               # unpack: cmp   r8, r9
+        "\x16\xd2",               #         bhs   plain
+        "\x37\xf8\x02\xab",       #         ldrh  r10, [r7], #2   ; token: count, bit 15 set for a run
+        "\x1a\xf4\x00\x4f",       #         tst   r10, #0x8000
+        "\x2a\xf4\x00\x4a",       #         bic   r10, r10, #0x8000
+        "\x07\xd1",               #         bne   run
+        "\x37\xf8\x02\xbb",       # literal: ldrh  r11, [r7], #2
+        "\x28\xf8\x02\xbb",       #         strh  r11, [r8], #2
+        "\xba\xf1\x01\x0a",       #         subs  r10, r10, #1
+        "\xf8\xd1",               #         bne   literal
+        "\xee\xe7",               #         b     unpack
+        "\x37\xf8\x02\xbb",       # run:    ldrh  r11, [r7], #2
+        "\x28\xf8\x02\xbb",       # fill:   strh  r11, [r8], #2
+        "\xba\xf1\x01\x0a",       #         subs  r10, r10, #1
+        "\xfa\xd1",               #         bne   fill
+        "\xe6\xe7",               #         b     unpack
+        "\x34\x26",               # plain:  movs  r6, #0x34       ; EOP|WRPRTERR|PGERR
+        "\xce\x60",               #         str   r6, [r1, #12]   ; SR
+        "\x96\x68",               #         ldr   r6, [r2, #8]
+        "\xf6\x07",               #         lsls  r6, r6, #31
+        "\x07\xd5",               #         bpl   program
+        "\x02\x26",               #         movs  r6, #0x02       ; PER
+        "\x0e\x61",               #         str   r6, [r1, #16]   ; CR
+        "\x4d\x61",               #         str   r5, [r1, #20]   ; AR
+        "\x42\x26",               #         movs  r6, #0x42       ; PER|STRT
+        "\x0e\x61",               #         str   r6, [r1, #16]
+        "\x00\xf0\x17\xf8",       #         bl    busy
+        "\x0a\xd1",               #         bne   done
+        "\x01\x26",               # program: movs  r6, #0x01       ; PG
+        "\x0e\x61",               #         str   r6, [r1, #16]
+        "\x34\xf8\x02\x6b",       # loop:   ldrh  r6, [r4], #2
+        "\x25\xf8\x02\x6b",       #         strh  r6, [r5], #2
+        "\x00\xf0\x0e\xf8",       #         bl    busy
+        "\x01\xd1",               #         bne   done
+        "\x9b\x1e",               #         subs  r3, r3, #2
+        "\xf6\xd8",               #         bhi   loop
+        "\x00\x27",               # done:   movs  r7, #0
+        "\x0f\x61",               #         str   r7, [r1, #16]
+        "\xd6\x60",               #         str   r6, [r2, #12]   ; status
+        "\x17\x61",               #         str   r7, [r2, #16]   ; length: completion
+        "\x07\x1d",               #         adds  r7, r0, #4
+        "\xba\x42",               #         cmp   r2, r7
+        "\x0c\xbf",               #         ite   eq
+        "\x00\xf1\x1c\x02",       #         addeq r2, r0, #28
+        "\x3a\x46",               #         movne r2, r7
+        "\xb6\xe7",               #         b     wait
+        "\xce\x68",               # busy:   ldr   r6, [r1, #12]
+        "\xf7\x07",               #         lsls  r7, r6, #31     ; BSY
+        "\xfc\xd4",               #         bmi   busy
+        "\x16\xf0\x14\x06",       #         ands  r6, r6, #0x14   ; WRPRTERR|PGERR
+        "\x70\x47",               #         bx    lr
+        ])
+
+    # SRAM layout: code, control block, stack top, then the two buffers and the two packed data buffers
+    CONTROL_OFFSET = 0x100
+    STACK_OFFSET = 0x200
+    DESCRIPTOR_SIZE = 24
+    DESCRIPTOR_STATUS = 12
+    DESCRIPTOR_LENGTH = 16
+    DESCRIPTOR_PACKED = 20
+    FLAG_ERASE = 1
+    FLAG_COMPRESSED = 2
+
+    def __init__(self, core, fpec, ram=0x20000000, block_size=1024):
+        self.core = core
+        self.fpec = fpec
+        self.ap = fpec.ap
+        self.ram = ram
+        self.block_size = block_size
+        self.control = ram + FlashLoader.CONTROL_OFFSET
+        # Bytes moved into the target by the last program()
+        self.bytes_sent = 0
+
+    def _descriptor(self, slot):
+        return self.control + 4 + slot * FlashLoader.DESCRIPTOR_SIZE
+
+    def _buffer(self, slot):
+        return self.ram + FlashLoader.STACK_OFFSET + slot * self.block_size
+
+    def _packed_buffer(self, slot):
+        return self._buffer(2 + slot)
+
+    def _write_data(self, address, data):
+        data += "\xFF" * (-len(data) & 3)
+        self.ap.write_mem_block(address, struct.unpack("<%dI" % (len(data) // 4), data))
+
+    def _halt(self):
+        self.core.set_dhcsr(debug_enable=1, halt=1)
+        while not self.core.get_dhcsr().halted:
+            pass
+
+    def _wait(self, slot, timeout_ms):
+        """Waits for the loader to be done with the buffer; returns the status of its block"""
+        descriptor = self._descriptor(slot)
+        matched, _, _ = self.ap.poll_mem_word(descriptor + FlashLoader.DESCRIPTOR_LENGTH, 0xFFFFFFFFL, 0, timeout_ms)
+        if not matched:
+            raise FPECException("flash loader still busy after %d ms" % timeout_ms)
+        return self.ap.read_mem_word(descriptor + FlashLoader.DESCRIPTOR_STATUS)
+
+    def program(self, address, data, erase=True, timeout_ms=1000, compress=True):
+        """Programs the data from address on, block by block; returns the addresses of the blocks which failed
+
+        With erase, every block is a page: address is page aligned and block_size is the page size.
+        With compress, blocks go in RLE compressed when it makes them smaller. The core is left halted.
+        """
+        if len(data) & 1:
+            data += "\xFF"
+        if not self.fpec.unlock():
+            raise FPECException("FPEC failed to unlock")
+        self._halt()
+        self._write_data(self.ram, FlashLoader.CODE)
+        self.ap.write_mem_block(self.control, [self.fpec.base] + [0] * (2 * FlashLoader.DESCRIPTOR_SIZE // 4))
+        self.core.write_reg(0, self.control)
+        self.core.write_reg(13, self.ram + FlashLoader.STACK_OFFSET)
+        self.core.write_reg(15, self.ram)
+        # Thumb state
+        self.core.write_reg(16, 0x01000000)
+        # Interrupts stay masked while the loader runs; C_MASKINTS only changes while halted
+        self.core.set_dhcsr(debug_enable=1, maskints=1, halt=1)
+        self.core.set_dhcsr(debug_enable=1, maskints=1, halt=0)
+
+        failed = []
+        pending = [None, None]
+        self.bytes_sent = 0
+        try:
+            for index, offset in enumerate(xrange(0, len(data), self.block_size)):
+                slot = index & 1
+                if pending[slot] is not None and self._wait(slot, timeout_ms):
+                    failed.append(pending[slot])
+                block = data[offset:offset + self.block_size]
+                descriptor = self._descriptor(slot)
+                flags = FlashLoader.FLAG_ERASE if erase else 0
+                packed = rle_compress(block) if compress else block
+                if len(packed) < len(block):
+                    # Expanded by the loader into the buffer
+                    flags |= FlashLoader.FLAG_COMPRESSED
+                    self._write_data(self._packed_buffer(slot), packed)
+                    self.ap.write_mem_word(descriptor + FlashLoader.DESCRIPTOR_PACKED, self._packed_buffer(slot))
+                    self.bytes_sent += len(packed)
+                else:
+                    self._write_data(self._buffer(slot), block)
+                    self.bytes_sent += len(block)
+                self.ap.write_mem_block(descriptor, [self._buffer(slot), address + offset, flags, 0])
+                # Handed over last
+                self.ap.write_mem_word(descriptor + FlashLoader.DESCRIPTOR_LENGTH, len(block))
+                pending[slot] = address + offset
+            for slot in xrange(2):
+                if pending[slot] is not None and self._wait(slot, timeout_ms):
+                    failed.append(pending[slot])
+        finally:
+            self._halt()
+        return sorted(failed)
+
+class IncrementalFlasher(object):
+    """Reprograms the flash page by page, only touching the pages which differ from the new image
+
+    Every page is compared by its CRC computed on the target (or read back) before anything is erased.
+    A cache per device, keyed by the device ID and unique ID, keeps the hashes of the pages programmed last;
+    when reading back, pages whose hash matches may be taken as is instead.
+    Pages which are all 0xFF in the new image are only erased.
+    """
+
+    DBGMCU_IDCODE = 0xE0042000
+    UNIQUE_ID = 0x1FFFF7E8
+
+    def __init__(self, fpec, page_size=1024, cache_dir=None, use_crc=True):
+        self.fpec = fpec
+        self.ap = fpec.ap
+        self.page_size = page_size
+        # Pages are compared by their CRC computed on the target rather than read back
+        self.use_crc = use_crc
+        self.cache_dir = cache_dir or os.path.expanduser("~/.armprobe/flash-cache")
+
+    def device_key(self):
+        """Returns the cache key of the target: device ID, then the 96-bit unique ID"""
+        dev_id = self.ap.read_mem_word(IncrementalFlasher.DBGMCU_IDCODE) & 0xFFF
+        uid = self.ap.read_mem_block(IncrementalFlasher.UNIQUE_ID, 3)
+        return "%03X-%08X%08X%08X" % (dev_id, uid[0], uid[1], uid[2])
+
+    def _cache_path(self, key):
+        return os.path.join(self.cache_dir, key + ".json")
+
+    def _load_cache(self, key):
+        try:
+            with open(self._cache_path(key)) as f:
+                return json.load(f)
+        except (IOError, ValueError):
+            return {}
+
+    def _save_cache(self, key, pages):
+        if not os.path.isdir(self.cache_dir):
+            os.makedirs(self.cache_dir)
+        with open(self._cache_path(key), "w") as f:
+            json.dump(pages, f, indent=1, sort_keys=True)
+
+    def _read_page(self, address):
+        words = self.ap.read_mem_block(address, self.page_size // 4)
+        return struct.pack("<%dI" % len(words), *words)
+
+    def program(self, address, data, trust_cache=False):
+        """Programs the data from the page aligned address on; returns the addresses of the pages rewritten
+
+        With trust_cache and without use_crc, pages matching the cache are not read back;
+        only for targets which never write their flash themselves.
+        """
+        data += "\xFF" * (-len(data) % self.page_size)
+        blank = "\xFF" * self.page_size
+        key = self.device_key()
+        cached = self._load_cache(key)
+        hashes = {}
+        changed = []
+        crcs = None
+        for offset in xrange(0, len(data), self.page_size):
+            page_address = address + offset
+            page = data[offset:offset + self.page_size]
+            digest = hashlib.sha1(page).hexdigest()
+            hashes["%08X" % page_address] = digest
+            if self.use_crc:
+                if crcs is None:
+                    crcs = target_crc32(self.ap, address, len(data), self.page_size)
+                if crcs[offset // self.page_size] != stm32_crc32(page):
+                    changed.append((page_address, page))
+            elif trust_cache and cached.get("%08X" % page_address) == digest:
+                continue
+            elif self._read_page(page_address) != page:
+                changed.append((page_address, page))
+
+        if changed and not self.fpec.unlock():
+            raise FPECException("FPEC failed to unlock")
+        failed = []
+        for page_address, page in changed:
+            if page == blank:
+                self.fpec.erase_flash_page(page_address)
+                if self._read_page(page_address) != blank:
+                    failed.append(page_address)
+            else:
+                failed.extend(self.fpec.program_flash_pages(page_address, page, self.page_size))
+        cached.update(hashes)
+        # Pages which failed are unknown from now on
+        for page_address in failed:
+            cached.pop("%08X" % page_address, None)
+        self._save_cache(key, cached)
+        if failed:
+            raise FPECException("failed to program pages at " + ", ".join("0x%08X" % a for a in failed))
+        return [page_address for page_address, _ in changed]
@@ -0,0 +1,162 @@
+"""
+Host tests of the ADI v5 wrappers against a simulated SW-DP and MEM-AP
+
+Run from this directory: python test_adiv5.py
+"""
+
+import sys
+import types
+import unittest
+
+try:
+    import usb1
+except (ImportError, OSError):
+    # Nothing here talks USB; the probe module only needs to import
+    sys.modules["usb1"] = types.ModuleType("usb1")
+
+from probe import SWDException
+from adiv5 import SWDebugPort, MemoryAccessPort, DPCTRLSTAT, DPABORT, DebugPort
+
+class SimulatedTransport(object):
+    """A SW-DP with posted AP reads, overrun detection and pushed verify/compare, in front of a word-only MEM-AP"""
+
+    # CTRL/STAT bits the host may write
+    CTRLSTAT_WRITABLE = 0xF0000F0DL
+
+    def __init__(self, memory):
+        self.memory = dict(memory)
+        self.ctrlstat = DPCTRLSTAT()
+        self.select = 0
+        self.rdbuff = 0
+        self.csw = 0x23000052L
+        self.tar = 0
+
+    def _sticky(self):
+        return self.ctrlstat.sticky_cmp or self.ctrlstat.sticky_err or self.ctrlstat.sticky_orun
+
+    def dp_read(self, a32):
+        if a32 == 1:
+            return long(self.ctrlstat)
+        if a32 == 3:
+            if self._sticky():
+                raise SWDException(4)
+            return self.rdbuff
+        return 0x2BA01477L
+
+    def dp_write(self, a32, data):
+        # Only ABORT goes through with a sticky flag set
+        if a32 != 0 and self._sticky():
+            raise SWDException(4)
+        if a32 == 0:
+            abort = DPABORT(data)
+            if abort.sticky_cmp:
+                self.ctrlstat.sticky_cmp = 0
+            if abort.sticky_err:
+                self.ctrlstat.sticky_err = 0
+            if abort.wdata_err:
+                self.ctrlstat.wdata_err = 0
+            if abort.sticky_orun:
+                self.ctrlstat.sticky_orun = 0
+        elif a32 == 1:
+            mask = SimulatedTransport.CTRLSTAT_WRITABLE
+            self.ctrlstat = DPCTRLSTAT((long(self.ctrlstat) & ~mask) | (data & mask))
+        elif a32 == 2:
+            self.select = data
+
+    def ap_read(self, a32):
+        if self._sticky():
+            raise SWDException(4)
+        data = self.rdbuff
+        if a32 == 0:
+            self.rdbuff = self.csw
+        elif a32 == 1:
+            self.rdbuff = self.tar
+        elif a32 == 3:
+            self.rdbuff = self.memory.get(self.tar, 0)
+            self.tar += 4
+        self.ctrlstat.read_ok = 1
+        return data
+
+    def ap_write(self, a32, data):
+        if self._sticky():
+            raise SWDException(4)
+        if a32 == 0:
+            self.csw = data
+        elif a32 == 1:
+            self.tar = data
+        elif a32 == 3:
+            mode = self.ctrlstat.transfer_mode
+            if mode == DebugPort.TRANSFER_MODE_NORMAL:
+                self.memory[self.tar] = data
+            else:
+                # Only the byte lanes in MASKLANE take part
+                mask = 0
+                for lane in xrange(4):
+                    if self.ctrlstat.masklane & (1 << lane):
+                        mask |= 0xFF << (lane * 8)
+                matched = (self.memory.get(self.tar, 0) & mask) == (data & mask)
+                if matched == (mode == DebugPort.TRANSFER_MODE_PUSHED_COMPARE):
+                    self.ctrlstat.sticky_cmp = 1
+            self.tar += 4
+
+    def execute_stream(self, ops):
+        values = []
+        completed = 0
+        status = 0
+        for is_read, is_ap, a32, data in ops:
+            try:
+                if is_ap:
+                    if is_read:
+                        values.append(self.ap_read(a32))
+                    else:
+                        self.ap_write(a32, data)
+                elif is_read:
+                    values.append(self.dp_read(a32))
+                else:
+                    self.dp_write(a32, data)
+            except SWDException:
+                # Only FAULTs are simulated
+                status = 4
+                break
+            completed += 1
+        return values, completed, long(self.ctrlstat), status
+
+class PushedVerifyTest(unittest.TestCase):
+    BASE = 0x20000000
+
+    def setUp(self):
+        # Crosses a 1KB boundary, so the verify takes two runs
+        self.words = [0x01000000 * (index & 0xFF) + index for index in xrange(0x180)]
+        self.transport = SimulatedTransport((PushedVerifyTest.BASE + index * 4, value) for index, value in enumerate(self.words))
+        self.dp = SWDebugPort(self.transport)
+        self.ap = MemoryAccessPort(self.dp, 0)
+
+    def assertRestored(self):
+        ctrlstat = self.transport.ctrlstat
+        self.assertEqual(ctrlstat.transfer_mode, DebugPort.TRANSFER_MODE_NORMAL)
+        self.assertEqual(ctrlstat.masklane, 0)
+        self.assertEqual(ctrlstat.overrun_detect, 0)
+        self.assertEqual(ctrlstat.sticky_cmp, 0)
+
+    def test_match(self):
+        self.assertEqual(self.ap.verify_mem_pushed(PushedVerifyTest.BASE, self.words), None)
+        self.assertRestored()
+
+    def test_mismatch_reported(self):
+        for index in (0, 5, 0xFF, 0x100, 0x17F):
+            address = PushedVerifyTest.BASE + index * 4
+            self.transport.memory[address] ^= 0x00010000
+            self.assertEqual(self.ap.verify_mem_pushed(PushedVerifyTest.BASE, self.words), address)
+            self.assertRestored()
+            self.transport.memory[address] ^= 0x00010000
+
+    def test_first_mismatch_reported(self):
+        self.transport.memory[PushedVerifyTest.BASE + 0x20 * 4] ^= 0x80000000
+        self.transport.memory[PushedVerifyTest.BASE + 0x40 * 4] ^= 0x80000000
+        self.assertEqual(self.ap.verify_mem_pushed(PushedVerifyTest.BASE, self.words), PushedVerifyTest.BASE + 0x20 * 4)
+
+    def test_unaligned_rejected(self):
+        self.assertRaises(ValueError, self.ap.verify_mem_pushed, PushedVerifyTest.BASE + 2, self.words)
+
+if __name__ == "__main__":
+    unittest.main()
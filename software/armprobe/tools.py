@@ -2,6 +2,10 @@
 Various small tools
 """
 
+import struct
+import time
+from probe import SWDException
+
 def build_memory_map(ap, first_addr=0x00000000, last_addr=0xFFFFFFFF, addr_increment=0x400):
     addr = first_addr
     pages_per_line = 64
@@ -14,7 +18,9 @@ def build_memory_map(ap, first_addr=0x00000000, last_addr=0xFFFFFFFF, addr_incre
         except SWDException as e:
             if e.response == 4:
                 line += '.'
-                ap.dp.set_abort(sticky_err=True)
+                # The probe may have cleared the sticky flags already
+                if not e.recovered:
+                    ap.dp.set_abort(sticky_err=True)
             else:
                 raise
         addr += addr_increment
@@ -26,7 +32,35 @@ def build_memory_map(ap, first_addr=0x00000000, last_addr=0xFFFFFFFF, addr_incre
 def mem_dump(ap, base, length, file):
     """Dump a memory range into a file"""
     with open(file, "wb") as fp:
-        # TODO: fix wraparound at 1k 
-        words = ap.read_mem_words(base, length // 4)
-        for x in words:
-            fp.write(struct.pack("<I", x))
+        # The probe re-programs TAR at every 1KB boundary
+        words = ap.read_mem_block(base, length // 4)
+        fp.write(struct.pack("<%dI" % len(words), *words))
+
+def verify_image(ap, base, image):
+    """Verify a memory range against an image with pushed verify; returns the first mismatch address or None"""
+    words = len(image) // 4
+    mismatch = ap.verify_mem_pushed(base, struct.unpack("<%dI" % words, image[:words * 4]))
+    if mismatch is not None:
+        return mismatch
+    # The tail is too short for a word
+    for offset in xrange(words * 4, len(image)):
+        if ap.read_mem_single(base + offset, 0) != ord(image[offset]):
+            return base + offset
+    return None
+
+def benchmark_flash_loader(loader, address, image, erase=True):
+    """Program an image (e.g. a firmware binary) with the flash loader, raw then compressed
+
+    Prints and returns the effective rate of both, in image bytes per second.
+    """
+    rates = []
+    for compress in (False, True):
+        start = time.time()
+        failed = loader.program(address, image, erase, compress=compress)
+        elapsed = time.time() - start
+        rate = len(image) / elapsed
+        print "%s: %d bytes in %.2f s, %d bytes sent, %.0f bytes/s%s" % (
+            "compressed" if compress else "raw", len(image), elapsed, loader.bytes_sent, rate,
+            " (%d blocks failed)" % len(failed) if failed else "")
+        rates.append(rate)
+    return tuple(rates)